@@ -1,7 +1,7 @@
 @echo off
 echo Compilando Clox...
 
-gcc src/chunk.c src/compiler.c src/context.c src/debug.c src/errors.c src/memory.c src/object.c src/scanner.c src/semantic.c src/table.c src/type_checking.c src/value.c src/vm.c src/coverage.c src/main.c -O3 -o c-lox.exe
+gcc src/chunk.c src/compiler.c src/context.c src/debug.c src/errors.c src/memory.c src/object.c src/scanner.c src/semantic.c src/table.c src/type_checking.c src/value.c src/vm.c src/optimizer.c src/bytecode.c src/slab.c src/simd.c src/sort.c src/coverage.c src/main.c -O3 -o c-lox.exe
 
 if %ERRORLEVEL% EQU 0 (
     echo Compilacao concluida com sucesso!
@@ -13,6 +13,7 @@ if %ERRORLEVEL% EQU 0 (
     echo   c-lox.exe --test            - Executar testes
     echo   c-lox.exe --optimize arquivo.lox - Executar com otimizacoes
     echo   c-lox.exe --ast arquivo.lox - Modo debug AST
+    echo   c-lox.exe --compile-only arquivo.lox - Gera arquivo.loxc
 ) else (
     echo Erro na compilacao!
 )
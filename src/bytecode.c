@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "bytecode.h"
+#include "chunk.h"
+#include "memory.h"
+#include "vm.h"
+
+// Formato do .loxc (inteiros na ordem de bytes da máquina que gerou o arquivo):
+//   "LOXC", versão, marcador de endianness, chave do fonte, tabela de globais
+//   (slot -> nome) e a função do script, com as funções aninhadas dentro das
+//   constantes. Os slots de globais são remapeados na carga.
+// A versão muda a cada alteração do formato, da lista de opcodes ou dos
+// operandos deles; arquivos de outra versão são ignorados.
+#define BYTECODE_MAGIC "LOXC"
+#define BYTECODE_VERSION 2
+#define BYTECODE_ENDIAN 0x01020304u
+
+typedef enum {
+    CONST_NUMBER,
+    CONST_STRING,
+    CONST_FUNCTION,
+    CONST_NIL,
+    CONST_TRUE,
+    CONST_FALSE
+} ConstantTag;
+
+typedef struct {
+    FILE* file;
+    bool failed;
+} Stream;
+
+BytecodeKey bytecodeKey(const char* path, const char* source) {
+    BytecodeKey key;
+    key.sourceHash = 14695981039346656037ull;
+    for (const char* c = source; *c != '\0'; c++) {
+        key.sourceHash ^= (uint8_t)*c;
+        key.sourceHash *= 1099511628211ull;
+    }
+
+    struct stat info;
+    key.sourceTime = stat(path, &info) == 0 ? (int64_t)info.st_mtime : 0;
+    return key;
+}
+
+static void writeBytes(Stream* out, const void* bytes, size_t size) {
+    if (out->failed) return;
+    if (fwrite(bytes, 1, size, out->file) != size) out->failed = true;
+}
+
+static void writeU8(Stream* out, uint8_t value) { writeBytes(out, &value, sizeof(value)); }
+static void writeU32(Stream* out, uint32_t value) { writeBytes(out, &value, sizeof(value)); }
+
+static void writeString(Stream* out, const char* chars, int length) {
+    writeU32(out, (uint32_t)length);
+    writeBytes(out, chars, (size_t)length);
+}
+
+static void writeFunction(Stream* out, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    writeU32(out, (uint32_t)function->arity);
+    writeU32(out, (uint32_t)function->upvalueCount);
+    writeU8(out, function->name != NULL);
+    if (function->name != NULL) {
+        writeString(out, function->name->chars, function->name->length);
+    }
+
+    writeU32(out, (uint32_t)chunk->count);
+    writeBytes(out, chunk->code, (size_t)chunk->count);
+    writeBytes(out, chunk->lines, sizeof(int) * (size_t)chunk->count);
+    writeU32(out, (uint32_t)chunk->cacheCount);
+
+    writeU32(out, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            writeU8(out, CONST_NUMBER);
+            writeBytes(out, &number, sizeof(number));
+        } else if (IS_STRING(value)) {
+            writeU8(out, CONST_STRING);
+            writeString(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+        } else if (IS_FUNCTION(value)) {
+            writeU8(out, CONST_FUNCTION);
+            writeFunction(out, AS_FUNCTION(value));
+        } else if (IS_NIL(value)) {
+            writeU8(out, CONST_NIL);
+        } else if (IS_BOOL(value)) {
+            writeU8(out, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+        } else {
+            out->failed = true;
+        }
+    }
+}
+
+bool saveBytecode(ObjFunction* function, const char* path, const BytecodeKey* key) {
+    // Escreve num arquivo temporário e renomeia, para que outro processo
+    // nunca leia um cache pela metade.
+    size_t length = strlen(path);
+    char* temp = (char*)malloc(length + 5);
+    if (temp == NULL) return false;
+    memcpy(temp, path, length);
+    memcpy(temp + length, ".tmp", 5);
+
+    Stream out = { fopen(temp, "wb"), false };
+    if (out.file == NULL) {
+        free(temp);
+        return false;
+    }
+
+    writeBytes(&out, BYTECODE_MAGIC, 4);
+    writeU8(&out, BYTECODE_VERSION);
+    writeU32(&out, BYTECODE_ENDIAN);
+    writeBytes(&out, &key->sourceHash, sizeof(key->sourceHash));
+    writeBytes(&out, &key->sourceTime, sizeof(key->sourceTime));
+
+    writeU32(&out, (uint32_t)vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.capacity; i++) {
+        Entry* entry = &vm.globalNames.entries[i];
+        if (entry->key == NULL) continue;
+        writeU32(&out, (uint32_t)AS_NUMBER(entry->value));
+        writeString(&out, entry->key->chars, entry->key->length);
+    }
+
+    writeFunction(&out, function);
+
+    bool ok = !out.failed;
+    if (fclose(out.file) != 0) ok = false;
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (ok && rename(temp, path) != 0) ok = false;
+    if (!ok) remove(temp);
+    free(temp);
+    return ok;
+}
+
+static void readBytes(Stream* in, void* bytes, size_t size) {
+    if (in->failed) {
+        memset(bytes, 0, size);
+        return;
+    }
+    if (fread(bytes, 1, size, in->file) != size) {
+        memset(bytes, 0, size);
+        in->failed = true;
+    }
+}
+
+static uint8_t readU8(Stream* in) {
+    uint8_t value;
+    readBytes(in, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t readU32(Stream* in) {
+    uint32_t value;
+    readBytes(in, &value, sizeof(value));
+    return value;
+}
+
+static ObjString* readString(Stream* in) {
+    uint32_t length = readU32(in);
+    if (in->failed || length > (1u << 30)) {
+        in->failed = true;
+        return NULL;
+    }
+
+    char* chars = (char*)malloc(length + 1);
+    if (chars == NULL) {
+        in->failed = true;
+        return NULL;
+    }
+    readBytes(in, chars, length);
+    ObjString* string = in->failed ? NULL : copyString(chars, (int)length);
+    free(chars);
+    return string;
+}
+
+// Deixa a função lida no topo da pilha da VM para protegê-la do GC.
+static ObjFunction* readFunction(Stream* in) {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    function->arity = (int)readU32(in);
+    function->upvalueCount = (int)readU32(in);
+    if (readU8(in)) function->name = readString(in);
+    if (function->name != NULL) writeBarrier((Obj*)function, OBJ_VAL(function->name));
+
+    uint32_t count = readU32(in);
+    if (in->failed || count > (1u << 28)) {
+        in->failed = true;
+        return function;
+    }
+    uint8_t* code = (uint8_t*)malloc(count);
+    int* lines = (int*)malloc(sizeof(int) * count);
+    if (code == NULL || lines == NULL) in->failed = true;
+    if (!in->failed) {
+        readBytes(in, code, count);
+        readBytes(in, lines, sizeof(int) * count);
+    }
+    for (uint32_t i = 0; i < count && !in->failed; i++) {
+        writeChunk(chunk, code[i], lines[i]);
+    }
+    free(code);
+    free(lines);
+
+    uint32_t cacheCount = readU32(in);
+    for (uint32_t i = 0; i < cacheCount && !in->failed; i++) {
+        addInlineCache(chunk);
+    }
+
+    uint32_t constantCount = readU32(in);
+    for (uint32_t i = 0; i < constantCount && !in->failed; i++) {
+        switch (readU8(in)) {
+            case CONST_NUMBER: {
+                double number;
+                readBytes(in, &number, sizeof(number));
+                addConstant(chunk, NUMBER_VAL(number));
+                break;
+            }
+            case CONST_STRING: {
+                ObjString* string = readString(in);
+                if (string == NULL) break;
+                addConstant(chunk, OBJ_VAL(string));
+                writeBarrier((Obj*)function, OBJ_VAL(string));
+                break;
+            }
+            case CONST_FUNCTION: {
+                ObjFunction* nested = readFunction(in);
+                addConstant(chunk, OBJ_VAL(nested));
+                writeBarrier((Obj*)function, OBJ_VAL(nested));
+                pop();
+                break;
+            }
+            case CONST_NIL:   addConstant(chunk, NIL_VAL); break;
+            case CONST_TRUE:  addConstant(chunk, BOOL_VAL(true)); break;
+            case CONST_FALSE: addConstant(chunk, BOOL_VAL(false)); break;
+            default:
+                in->failed = true;
+                break;
+        }
+    }
+    return function;
+}
+
+static bool constantIs(Chunk* chunk, int index, ObjType type) {
+    return index < chunk->constants.count && isObjType(chunk->constants.values[index], type);
+}
+
+// Superinstruções: o caminho rápido pula a sequência original inteira, que
+// precisa estar logo depois (ver optimizer.c).
+static bool fusedSequenceIntact(Chunk* chunk, int offset) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_ADD_LOCALS:
+            return offset + 4 < chunk->count && code[2] == OP_GET_LOCAL && code[4] == OP_ADD;
+        case OP_LESS_JUMP:
+        case OP_GREATER_JUMP:
+            return offset + 4 < chunk->count && code[1] == OP_JUMP_IF_FALSE && code[4] == OP_POP;
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            return offset + 1 < chunk->count && code[1] == OP_NOT;
+        default:
+            return true;
+    }
+}
+
+// O arquivo pode ter sido corrompido ou editado: todo operando que a VM usa
+// como índice sem conferir (constantes, inline caches, upvalues, locais,
+// destinos de salto) é verificado aqui antes da primeira execução. Também
+// calcula maxStack, que a VM usa para reservar a pilha de cada chamada.
+static bool validateFunction(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    if (function->arity < 0 || function->arity > UINT8_MAX ||
+        function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT) {
+        return false;
+    }
+    // As aninhadas primeiro: o tamanho de um OP_CLOSURE vem do upvalueCount
+    // da função que ele cria.
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_FUNCTION(value) && !validateFunction(AS_FUNCTION(value))) return false;
+    }
+
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t* code = &chunk->code[offset];
+        if (code[0] > OP_ITER_NEXT) return false;
+        if (code[0] == OP_CLOSURE &&
+            (offset + 2 >= chunk->count || !constantIs(chunk, code[1] << 8 | code[2], OBJ_FUNCTION))) {
+            return false;
+        }
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count || !fusedSequenceIntact(chunk, offset)) return false;
+
+        switch (code[0]) {
+            case OP_CONSTANT:
+                if (code[1] >= chunk->constants.count) return false;
+                break;
+            case OP_CONSTANT_16:
+                if ((code[1] << 8 | code[2]) >= chunk->constants.count) return false;
+                break;
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                if (code[1] >= function->upvalueCount) return false;
+                break;
+            case OP_GET_SUPER:
+            case OP_SUPER_INVOKE:
+            case OP_CLASS:
+            case OP_METHOD:
+                if (!constantIs(chunk, code[1] << 8 | code[2], OBJ_STRING)) return false;
+                break;
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+                if (!constantIs(chunk, code[1] << 8 | code[2], OBJ_STRING) ||
+                    (code[3] << 8 | code[4]) >= chunk->cacheCount) {
+                    return false;
+                }
+                break;
+            case OP_INVOKE:
+                if (!constantIs(chunk, code[1] << 8 | code[2], OBJ_STRING) ||
+                    (code[4] << 8 | code[5]) >= chunk->cacheCount) {
+                    return false;
+                }
+                break;
+            case OP_ITER_NEXT:
+                if (code[2] != 1 && code[2] != 2) return false;
+                break;
+            case OP_CLOSURE:
+                for (int i = 3; i < length; i += 2) {
+                    if (code[i] > 1) return false;
+                    if (!code[i] && code[i + 1] >= function->upvalueCount) return false;
+                }
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+
+    // Saltos, altura da pilha e locais.
+    function->maxStack = chunkStackDepth(chunk, function->arity + 1);
+    return function->maxStack >= 0;
+}
+
+// Troca os slots de globais gravados no arquivo pelos slots desta VM.
+static bool remapGlobals(ObjFunction* function, const int* remap, int remapCount) {
+    Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_GET_GLOBAL_SLOT || instruction == OP_SET_GLOBAL_SLOT ||
+            instruction == OP_DEFINE_GLOBAL) {
+            if (offset + 2 >= chunk->count) return false;
+            int slot = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            if (slot >= remapCount || remap[slot] < 0) return false;
+            chunk->code[offset + 1] = (uint8_t)((remap[slot] >> 8) & 0xff);
+            chunk->code[offset + 2] = (uint8_t)(remap[slot] & 0xff);
+        }
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_FUNCTION(value) && !remapGlobals(AS_FUNCTION(value), remap, remapCount)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+ObjFunction* loadBytecode(const char* path, const BytecodeKey* expected) {
+    Stream in = { fopen(path, "rb"), false };
+    if (in.file == NULL) return NULL;
+
+    char magic[4];
+    readBytes(&in, magic, sizeof(magic));
+    uint8_t version = readU8(&in);
+    uint32_t endian = readU32(&in);
+    if (in.failed || memcmp(magic, BYTECODE_MAGIC, 4) != 0 || version != BYTECODE_VERSION ||
+        endian != BYTECODE_ENDIAN) {
+        fclose(in.file);
+        return NULL;
+    }
+
+    BytecodeKey key;
+    readBytes(&in, &key.sourceHash, sizeof(key.sourceHash));
+    readBytes(&in, &key.sourceTime, sizeof(key.sourceTime));
+    if (in.failed ||
+        (expected != NULL && (key.sourceHash != expected->sourceHash ||
+                              key.sourceTime != expected->sourceTime))) {
+        fclose(in.file);
+        return NULL;
+    }
+
+    Value* base = vm.stackTop;
+    int remapCount = 0;
+    int* remap = NULL;
+    uint32_t globalCount = readU32(&in);
+    for (uint32_t i = 0; i < globalCount && !in.failed; i++) {
+        uint32_t slot = readU32(&in);
+        ObjString* name = readString(&in);
+        if (in.failed || slot > UINT16_MAX) {
+            in.failed = true;
+            break;
+        }
+        if ((int)slot >= remapCount) {
+            int oldCount = remapCount;
+            remapCount = (int)slot + 1;
+            remap = (int*)realloc(remap, sizeof(int) * remapCount);
+            if (remap == NULL) exit(1);
+            for (int j = oldCount; j < remapCount; j++) remap[j] = -1;
+        }
+        int newSlot = globalSlot(name);
+        if (newSlot > UINT16_MAX) in.failed = true;
+        remap[slot] = newSlot;
+    }
+
+    ObjFunction* function = NULL;
+    if (!in.failed) {
+        function = readFunction(&in);
+        // O script roda como closure sem argumentos nem upvalues.
+        if (!in.failed && (function->arity != 0 || function->upvalueCount != 0 ||
+                           !validateFunction(function))) {
+            in.failed = true;
+        }
+        if (!in.failed && !remapGlobals(function, remap, remapCount)) in.failed = true;
+    }
+
+    free(remap);
+    fclose(in.file);
+    vm.stackTop = base;
+    return in.failed ? NULL : function;
+}
@@ -0,0 +1,18 @@
+#ifndef clox_bytecode_h
+#define clox_bytecode_h
+
+#include "common.h"
+#include "object.h"
+
+// Identifica o fonte que gerou um arquivo .loxc; o cache só é reaproveitado
+// quando hash e data de modificação batem.
+typedef struct {
+    uint64_t sourceHash;
+    int64_t sourceTime;
+} BytecodeKey;
+
+BytecodeKey bytecodeKey(const char* path, const char* source);
+bool saveBytecode(ObjFunction* function, const char* path, const BytecodeKey* key);
+ObjFunction* loadBytecode(const char* path, const BytecodeKey* expected);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 
@@ -10,6 +11,10 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;
+    chunk->deopts = NULL;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -32,9 +37,280 @@ int addConstant(Chunk* chunk, Value value) {
     return chunk->constants.count - 1;
 }
 
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    InlineCache* cache = &chunk->caches[chunk->cacheCount];
+    cache->count = 0;
+    cache->next = 0;
+    return chunk->cacheCount++;
+}
+
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+    free(chunk->deopts);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_INTEGER:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_ADD_LOCALS:
+        case OP_BUILD_LIST:
+            return 2;
+        case OP_CONSTANT_16:
+        case OP_INTEGER_16:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_SUPER:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 3;
+        case OP_SUPER_INVOKE:
+            return 4;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_ITER_NEXT:
+            return 5;
+        case OP_INVOKE:
+            return 6;
+        case OP_CLOSURE: {
+            uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8 | chunk->code[offset + 2]);
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 3 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+// Efeito de uma instrução na pilha: quantos valores ela consome e quantos
+// deixa. As superinstruções contam como a primeira instrução da sequência
+// original, que continua no chunk logo depois delas.
+static void stackEffect(Chunk* chunk, int offset, int* pops, int* pushes) {
+    uint8_t* code = &chunk->code[offset];
+    *pops = 0;
+    *pushes = 0;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_16:
+        case OP_INTEGER:
+        case OP_INTEGER_16:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_MINUS_ONE:
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_ADD_LOCALS:
+            *pushes = 1;
+            break;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_RETURN:
+            *pops = 1;
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP_IF_FALSE:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_LESS_JUMP:
+        case OP_GREATER_JUMP:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_INDEX_GET:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_INDEX_SET:
+            *pops = 3;
+            *pushes = 1;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            *pops = code[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_INVOKE:
+            *pops = code[3] + 1;
+            *pushes = 1;
+            break;
+        case OP_SUPER_INVOKE:
+            *pops = code[3] + 2;
+            *pushes = 1;
+            break;
+        case OP_BUILD_LIST:
+            *pops = code[1];
+            *pushes = 1;
+            break;
+        case OP_ITER_INIT:
+            *pops = 1;
+            *pushes = 2;
+            break;
+        case OP_ITER_NEXT:
+            *pushes = code[2];
+            break;
+        default:
+            break;
+    }
+}
+
+// Destino do salto da instrução em offset; false se ela não salta.
+static bool jumpTarget(Chunk* chunk, int offset, int* target) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+            *target = offset + 3 + (code[1] << 8 | code[2]);
+            return true;
+        case OP_LOOP:
+            *target = offset + 3 - (code[1] << 8 | code[2]);
+            return true;
+        case OP_ITER_NEXT:
+            *target = offset + 5 + (code[3] << 8 | code[4]);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool mergeDepth(int* depths, int* work, int* workCount, int offset, int depth) {
+    if (depths[offset] >= 0) return depths[offset] == depth;
+    depths[offset] = depth;
+    work[(*workCount)++] = offset;
+    return true;
+}
+
+// Locais lidos pela instrução precisam estar abaixo do topo da pilha.
+static bool localsInRange(Chunk* chunk, int offset, int depth) {
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+            return code[1] < depth;
+        case OP_ADD_LOCALS:
+            return code[1] < depth && code[3] < depth;
+        case OP_ITER_NEXT:
+            return code[1] + 1 < depth;
+        case OP_CLOSURE: {
+            int length = instructionLength(chunk, offset);
+            for (int i = 3; i < length; i += 2) {
+                if (code[i] && code[i + 1] >= depth) return false;
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+// Maior altura da pilha (a partir do slot 0 do frame) que o código da função
+// alcança, começando com base valores (função e argumentos). Percorre todos
+// os caminhos do fluxo de controle; devolve -1 se o bytecode for
+// inconsistente: instrução cortada, salto para fora do chunk ou para o meio
+// de outra instrução, pilha que fica negativa ou com alturas diferentes no
+// mesmo ponto, local acima do topo.
+int chunkStackDepth(Chunk* chunk, int base) {
+    if (chunk->count <= 0) return -1;
+
+    // depths[i] >= 0 marca o início de uma instrução já alcançada.
+    int* depths = (int*)malloc(sizeof(int) * chunk->count);
+    int* work = (int*)malloc(sizeof(int) * chunk->count);
+    if (depths == NULL || work == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++) depths[i] = -1;
+
+    int maxDepth = base;
+    int workCount = 0;
+    bool ok = mergeDepth(depths, work, &workCount, 0, base);
+    while (ok && workCount > 0) {
+        int offset = work[--workCount];
+        int length = instructionLength(chunk, offset);
+        if (offset + length > chunk->count) {
+            ok = false;
+            break;
+        }
+
+        int pops, pushes;
+        stackEffect(chunk, offset, &pops, &pushes);
+        if (depths[offset] < pops || !localsInRange(chunk, offset, depths[offset])) {
+            ok = false;
+            break;
+        }
+        int depth = depths[offset] - pops + pushes;
+        if (depth > maxDepth) maxDepth = depth;
+
+        uint8_t instruction = chunk->code[offset];
+        int target;
+        if (jumpTarget(chunk, offset, &target)) {
+            // O salto do OP_ITER_NEXT sai sem empilhar nada.
+            int targetDepth = instruction == OP_ITER_NEXT ? depths[offset] : depth;
+            ok = target >= 0 && target < chunk->count &&
+                 mergeDepth(depths, work, &workCount, target, targetDepth);
+        }
+        if (instruction == OP_RETURN || instruction == OP_JUMP || instruction == OP_LOOP) continue;
+
+        int next = offset + length;
+        ok = ok && next < chunk->count && mergeDepth(depths, work, &workCount, next, depth);
+    }
+
+    // Um salto para dentro de uma instrução já lida também é inconsistente.
+    for (int offset = 0; ok && offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        for (int i = 1; i < instructionLength(chunk, offset) && offset + i < chunk->count; i++) {
+            if (depths[offset + i] >= 0) ok = false;
+        }
+    }
+
+    free(depths);
+    free(work);
+    return ok ? maxDepth : -1;
+}
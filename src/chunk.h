@@ -4,6 +4,8 @@
 #include "common.h"
 #include "value.h"
 
+// Mudanças nesta lista ou nos operandos exigem incrementar BYTECODE_VERSION
+// (bytecode.c).
 typedef enum {
     OP_CONSTANT,
     OP_CONSTANT_16,
@@ -18,8 +20,8 @@ typedef enum {
     OP_POP,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
-    OP_GET_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_GET_GLOBAL_SLOT,
+    OP_SET_GLOBAL_SLOT,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_SET_PROPERTY,
@@ -47,20 +49,69 @@ typedef enum {
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_TAIL_CALL,
+    OP_ADD_LOCALS,
+    OP_LESS_JUMP,
+    OP_GREATER_JUMP,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    OP_BUILD_LIST,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    OP_ITER_INIT,
+    OP_ITER_NEXT
 } OpCode;
 
+#define INLINE_CACHE_SIZE 4
+
+struct ObjClass;
+struct ObjShape;
+
+// Entrada de inline cache, válida para instâncias com a mesma classe e shape.
+// Para campos, slot é o índice no array de valores da instância (e transition
+// a shape resultante quando o SET adiciona o campo); para métodos, slot é -1
+// e method guarda a closure.
+typedef struct {
+    struct ObjClass* klass;
+    struct ObjShape* shape;
+    struct ObjShape* transition;
+    int slot;
+    Value method;
+} InlineCacheEntry;
+
+typedef struct {
+    int count;
+    int next;
+    InlineCacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    int cacheCount;
+    int cacheCapacity;
+    InlineCache* caches;
+    uint8_t* deopts;    // desotimizações por offset; alocado na primeira
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
 void freeChunk(Chunk* chunk);
+int instructionLength(Chunk* chunk, int offset);
+int chunkStackDepth(Chunk* chunk, int base);
 
 #endif
\ No newline at end of file
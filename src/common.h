@@ -7,6 +7,10 @@
 
 #define NAN_BOXING
 
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
@@ -1,12 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
 #include "object.h"
 #include "memory.h"
 #include "coverage.h"
+#include "optimizer.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"    
@@ -20,6 +23,7 @@ typedef struct
     Token previous;
     bool hadError;
     bool panicMode;
+    int operandStart;   // início do código do operando esquerdo do operador infixo
 } Parser;
 
 typedef enum {
@@ -72,6 +76,9 @@ typedef struct Compiler {
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastCall;   // offset do último OP_CALL emitido, para detectar tail calls
+    int numericStart;   // último trecho [numericStart, numericEnd) que com
+    int numericEnd;     // certeza produz um número
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -181,6 +188,7 @@ static void emitReturn() {
 
 static uint16_t makeConstant(Value value) {
     int constant = addConstant(currentChunk(), value);
+    writeBarrier((Obj*)current->function, value);
     if (constant > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -189,10 +197,30 @@ static uint16_t makeConstant(Value value) {
     return (uint16_t)constant;
 }
 
+static uint16_t makeInlineCache() {
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+        return 0;
+    }
+
+    return (uint16_t)cache;
+}
+
 static uint16_t identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
+static uint16_t globalVariable(Token* name) {
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
 static void emitConstant(Value value) {
     uint16_t constant = makeConstant(value);
     
@@ -205,6 +233,38 @@ static void emitConstant(Value value) {
     }
 }
 
+// Inteiros pequenos não gastam entrada na tabela de constantes.
+static void emitNumber(double number) {
+    if (number == -1) {
+        emitByte(OP_MINUS_ONE);
+    } else if (number == 0 && !signbit(number)) {
+        emitByte(OP_ZERO);
+    } else if (number == 1) {
+        emitByte(OP_ONE);
+    } else if (number > 0 && number <= UINT16_MAX && (int)number == number) {
+        if (number <= UINT8_MAX) {
+            emitBytes(OP_INTEGER, (uint8_t)number);
+        } else {
+            emitByte(OP_INTEGER_16);
+            emitShort((uint16_t)number);
+        }
+    } else {
+        emitConstant(NUMBER_VAL(number));
+    }
+}
+
+static void emitValue(Value value) {
+    if (IS_NUMBER(value)) {
+        emitNumber(AS_NUMBER(value));
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else {
+        emitConstant(value);
+    }
+}
+
 static void patchJump(int offset) {
     int jump = currentChunk()->count - offset - 2;
 
@@ -222,10 +282,14 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
+    compiler->numericStart = -1;
+    compiler->numericEnd = -1;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
     Local* local = &current->locals[current->localCount++];
@@ -244,6 +308,11 @@ static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
 
+    if (!parser.hadError) {
+        optimizeChunk(currentChunk());
+        function->maxStack = chunkStackDepth(currentChunk(), function->arity + 1);
+    }
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -280,8 +349,127 @@ static void parsePrecedence(Precedence precedence);
 static void lambda(bool canAssign);
 static void lambdaBlock();
 
+// Dobra de constantes. Os operandos de binary() e unary() são trechos
+// [start, end) do chunk; quando o trecho é uma única instrução que carrega
+// uma constante, o valor já é conhecido e a operação roda aqui mesmo. Um
+// trecho assim não tem alvo de salto no meio, então pode ser reescrito.
+static bool constantAt(int start, int end, Value* value) {
+    Chunk* chunk = currentChunk();
+    if (start >= end || instructionLength(chunk, start) != end - start) return false;
+    uint8_t* code = &chunk->code[start];
+    switch (code[0]) {
+        case OP_CONSTANT:    *value = chunk->constants.values[code[1]]; break;
+        case OP_CONSTANT_16: *value = chunk->constants.values[code[1] << 8 | code[2]]; break;
+        case OP_INTEGER:     *value = NUMBER_VAL(code[1]); break;
+        case OP_INTEGER_16:  *value = NUMBER_VAL(code[1] << 8 | code[2]); break;
+        case OP_MINUS_ONE:   *value = NUMBER_VAL(-1); break;
+        case OP_ZERO:        *value = NUMBER_VAL(0); break;
+        case OP_ONE:         *value = NUMBER_VAL(1); break;
+        case OP_NIL:         *value = NIL_VAL; break;
+        case OP_TRUE:        *value = BOOL_VAL(true); break;
+        case OP_FALSE:       *value = BOOL_VAL(false); break;
+        default: return false;
+    }
+    return true;
+}
+
+static bool isNumericCode(int start, int end) {
+    Value value;
+    if (constantAt(start, end, &value)) return IS_NUMBER(value);
+    return current->numericStart == start && current->numericEnd == end;
+}
+
+static void markNumeric(int start) {
+    current->numericStart = start;
+    current->numericEnd = currentChunk()->count;
+}
+
+// Tira do chunk a instrução de constante em [start, end), juntando o que vem
+// depois. A constante sai da tabela se foi a última adicionada (ninguém mais
+// a usa: o compilador não reaproveita entradas).
+static void removeConstant(int start, int end) {
+    Chunk* chunk = currentChunk();
+    int index = -1;
+    if (chunk->code[start] == OP_CONSTANT) index = chunk->code[start + 1];
+    if (chunk->code[start] == OP_CONSTANT_16) {
+        index = chunk->code[start + 1] << 8 | chunk->code[start + 2];
+    }
+    if (index >= 0 && index == chunk->constants.count - 1) chunk->constants.count--;
+
+    int length = end - start;
+    memmove(&chunk->code[start], &chunk->code[end], (size_t)(chunk->count - end));
+    memmove(&chunk->lines[start], &chunk->lines[end], sizeof(int) * (size_t)(chunk->count - end));
+    chunk->count -= length;
+    if (current->lastCall >= end) current->lastCall -= length;
+    if (current->numericStart >= end) {
+        current->numericStart -= length;
+        current->numericEnd -= length;
+    } else if (current->numericEnd > start) {
+        current->numericStart = current->numericEnd = -1;
+    }
+}
+
+// Avalia a operação como a VM faria; false quando ela daria erro (ou
+// chamaria código Lox), e aí o código fica como está.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                ObjString* left = AS_STRING(a);
+                ObjString* right = AS_STRING(b);
+                ObjString* string = allocateString(left->length + right->length);
+                memcpy(string->chars, left->chars, left->length);
+                memcpy(string->chars + left->length, right->chars, right->length);
+                *result = OBJ_VAL(takeString(string));
+                return true;
+            }
+            if (!numbers) return false;
+            *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            return true;
+        case TOKEN_MINUS:
+            if (!numbers) return false;
+            *result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+            return true;
+        case TOKEN_STAR:
+            if (!numbers) return false;
+            *result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+            return true;
+        case TOKEN_SLASH:
+            if (!numbers || AS_NUMBER(b) == 0) return false;
+            *result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+            return true;
+        // >= e <= compilam como not < e not >, e é isso que a VM calcula.
+        case TOKEN_GREATER:       if (!numbers) return false; *result = BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b)); return true;
+        case TOKEN_GREATER_EQUAL: if (!numbers) return false; *result = BOOL_VAL(!(AS_NUMBER(a) < AS_NUMBER(b))); return true;
+        case TOKEN_LESS:          if (!numbers) return false; *result = BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b)); return true;
+        case TOKEN_LESS_EQUAL:    if (!numbers) return false; *result = BOOL_VAL(!(AS_NUMBER(a) > AS_NUMBER(b))); return true;
+        // Constantes string são internadas: igualdade de ponteiro basta.
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        default:
+            return false;
+    }
+}
+
+// x * 1, 1 * x, x / 1 e x - 0 com x numérico não mudam x. x + 0 fica de
+// fora: -0 + 0 dá 0.
+static bool isIdentity(TokenType operatorType, Value constant, bool constantOnRight) {
+    if (!IS_NUMBER(constant)) return false;
+    double number = AS_NUMBER(constant);
+    switch (operatorType) {
+        case TOKEN_STAR:  return number == 1;
+        case TOKEN_SLASH: return constantOnRight && number == 1;
+        case TOKEN_MINUS: return constantOnRight && number == 0 && !signbit(number);
+        default:          return false;
+    }
+}
+
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    int leftStart = parser.operandStart;
+    int rightStart = currentChunk()->count;
+    bool leftNumeric = isNumericCode(leftStart, rightStart);
     ParseRule* rule = getRule(operatorType);
     if (debugAstMode) {
         printf("(");
@@ -305,6 +493,28 @@ static void binary(bool canAssign) {
         printf(")");
     }
     if (!debugAstMode) {
+        int end = currentChunk()->count;
+        bool rightNumeric = isNumericCode(rightStart, end);
+        Value a, b, result;
+        bool leftConstant = constantAt(leftStart, rightStart, &a);
+        bool rightConstant = constantAt(rightStart, end, &b);
+        if (leftConstant && rightConstant && foldBinary(operatorType, a, b, &result)) {
+            removeConstant(rightStart, end);
+            removeConstant(leftStart, rightStart);
+            emitValue(result);
+            return;
+        }
+        if (rightConstant && leftNumeric && isIdentity(operatorType, b, true)) {
+            removeConstant(rightStart, end);
+            markNumeric(leftStart);
+            return;
+        }
+        if (leftConstant && rightNumeric && isIdentity(operatorType, a, false)) {
+            removeConstant(leftStart, rightStart);
+            markNumeric(leftStart);
+            return;
+        }
+
         switch (operatorType) {
             case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
             case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
@@ -318,6 +528,10 @@ static void binary(bool canAssign) {
             case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
             default: return;
         }
+        // Sem sobrecarga possível (operandos números), o resultado é número.
+        bool arithmetic = operatorType == TOKEN_PLUS || operatorType == TOKEN_MINUS ||
+                          operatorType == TOKEN_STAR || operatorType == TOKEN_SLASH;
+        if (arithmetic && leftNumeric && rightNumeric) markNumeric(leftStart);
     }
 }
 
@@ -344,9 +558,46 @@ static void call(bool canAssign) {
         return;
     }
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
+static void listLiteral(bool canAssign) {
+    int count = 0;
+    if (debugAstMode) printf("(list");
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (debugAstMode) printf(" ");
+            expression();
+            if (count == 255) {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    if (debugAstMode) {
+        printf(")");
+        return;
+    }
+    emitBytes(OP_BUILD_LIST, (uint8_t)count);
+}
+
+static void index_(bool canAssign) {
+    if (debugAstMode) printf("(index ");
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        if (debugAstMode) printf(" = ");
+        expression();
+        emitByte(OP_INDEX_SET);
+    } else {
+        emitByte(OP_INDEX_GET);
+    }
+    if (debugAstMode) printf(")");
+}
+
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
     uint16_t name = identifierConstant(&parser.previous);
@@ -355,14 +606,17 @@ static void dot(bool canAssign) {
         expression();
         emitByte(OP_SET_PROPERTY);
         emitShort(name);
+        emitShort(makeInlineCache());
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         emitByte(OP_INVOKE);
         emitShort(name);
         emitByte(argCount);
+        emitShort(makeInlineCache());
     } else {
         emitByte(OP_GET_PROPERTY);
         emitShort(name);
+        emitShort(makeInlineCache());
     }
 }
 
@@ -396,7 +650,7 @@ static void number(bool canAssign) {
         printf("%.*s", parser.previous.length, parser.previous.start);
     } else {
         double value = strtod(parser.previous.start, NULL);
-        emitConstant(NUMBER_VAL(value));
+        emitNumber(value);
     }
 }
 
@@ -532,9 +786,9 @@ static void namedVariable(Token name, bool canAssign) {
         setOp = OP_SET_UPVALUE;
     } else {
         isConstant = true;
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        arg = globalVariable(&name);
+        getOp = OP_GET_GLOBAL_SLOT;
+        setOp = OP_SET_GLOBAL_SLOT;
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
@@ -605,12 +859,31 @@ static void this_(bool canAssign) {
 
 static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    int start = currentChunk()->count;
 
     parsePrecedence(PREC_UNARY);
 
+    Value operand;
+    if (constantAt(start, currentChunk()->count, &operand)) {
+        if (operatorType == TOKEN_BANG) {
+            removeConstant(start, currentChunk()->count);
+            emitValue(BOOL_VAL(IS_NIL(operand) || (IS_BOOL(operand) && !AS_BOOL(operand))));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+            removeConstant(start, currentChunk()->count);
+            emitNumber(-AS_NUMBER(operand));
+            return;
+        }
+    }
+
     switch (operatorType) {
         case TOKEN_BANG:  emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_MINUS:
+            // OP_NEGATE só aceita números (não há __neg__).
+            emitByte(OP_NEGATE);
+            markNumeric(start);
+            break;
         default: return;
     }
 }
@@ -620,6 +893,8 @@ ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_LEFT_BRACKET]  = {listLiteral, index_, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
     [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
     [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -645,6 +920,7 @@ ParseRule rules[] = {
     [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_IN]            = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LAMBDA]        = {lambda,   NULL,   PREC_NONE},
     [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
     [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
@@ -668,11 +944,13 @@ static void parsePrecedence(Precedence precedence) {
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->count;
     prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        parser.operandStart = start;
         infixRule(canAssign);
     }
 
@@ -687,7 +965,7 @@ static uint16_t parseVariable(const char* errorMessage) {
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -824,7 +1102,7 @@ static void classDeclaration() {
 
     emitByte(OP_CLASS);
     emitShort(name);
-    defineVariable(name);
+    defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
@@ -884,14 +1162,72 @@ static void expressionStatement() {
     emitByte(OP_POP);
 }
 
+static bool forInAhead() {
+    if (!check(TOKEN_IDENTIFIER)) return false;
+    TokenType next = peekToken().type;
+    return next == TOKEN_IN || next == TOKEN_COMMA;
+}
+
+// for (x in seq) / for (k, v in seq). O iterável e o estado da iteração
+// ficam em dois locais ocultos; OP_ITER_NEXT empilha o(s) próximo(s)
+// valor(es) ou salta para o fim.
+static void forInStatement() {
+    coverage_hit("for_in_statement");
+    consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+    Token first = parser.previous;
+    Token second = first;
+    int varCount = 1;
+    if (match(TOKEN_COMMA)) {
+        consume(TOKEN_IDENTIFIER, "Expect second loop variable name.");
+        second = parser.previous;
+        varCount = 2;
+    }
+    consume(TOKEN_IN, "Expect 'in' after loop variables.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for-in clause.");
+
+    addLocal(syntheticToken("for seq"));
+    markInitialized();
+    int seqSlot = current->localCount - 1;
+    emitByte(OP_ITER_INIT);
+    addLocal(syntheticToken("for state"));
+    markInitialized();
+
+    int loopStart = currentChunk()->count;
+    emitBytes(OP_ITER_NEXT, (uint8_t)seqSlot);
+    emitByte((uint8_t)varCount);
+    emitShort(0xffff);
+    int exitJump = currentChunk()->count - 2;
+
+    beginScope();
+    addLocal(first);
+    markInitialized();
+    if (varCount == 2) {
+        addLocal(second);
+        markInitialized();
+    }
+    statement();
+    endScope();
+
+    emitLoop(loopStart);
+    patchJump(exitJump);
+}
+
 static void forStatement() {
     coverage_hit("for_statement");
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(TOKEN_SEMICOLON)) {
-        // No initializer.
-    } else if (match(TOKEN_VAR)) {
+    bool isVar = match(TOKEN_VAR);
+    if (forInAhead()) {
+        forInStatement();
+        endScope();
+        return;
+    }
+
+    if (isVar) {
         varDeclaration();
+    } else if (match(TOKEN_SEMICOLON)) {
+        // No initializer.
     } else {
         expressionStatement();
     }
@@ -971,6 +1307,12 @@ static void returnStatement() {
 
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+        // Se a chamada foi a última instrução emitida, o valor dela é o
+        // próprio retorno e o frame atual pode ser reaproveitado.
+        if (current->lastCall >= 0 && current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
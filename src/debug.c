@@ -28,6 +28,20 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
+static int fusedLocalsInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 3];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 2;
+}
+
 static int constantValueInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
@@ -59,14 +73,38 @@ static int constantInstruction16(const char* name, Chunk* chunk, int offset) {
 }
 
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
-    uint8_t argCount = chunk->code[offset + 2];
+    uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
     printf("%-16s (%d args) %d '", name, argCount, constant);
     printValue(stdout, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 4;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+    cache |= chunk->code[offset + 4];
+    printf("%-16s %4d '", name, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 5;
+}
+
+static int invokeCachedInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
+    constant |= chunk->code[offset + 2];
+    uint8_t argCount = chunk->code[offset + 3];
+    uint16_t cache = (uint16_t)(chunk->code[offset + 4] << 8);
+    cache |= chunk->code[offset + 5];
+    printf("%-16s (%d args) %d '", name, argCount, constant);
+    printValue(stdout, chunk->constants.values[constant]);
+    printf("' ic %d\n", cache);
+    return offset + 6;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
@@ -94,20 +132,20 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL:
-            return constantValueInstruction16("OP_GET_GLOBAL", chunk, offset);    
-        case OP_SET_GLOBAL:
-            return constantValueInstruction16("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_SLOT:
+            return shortInstruction("OP_GET_GLOBAL_SLOT", chunk, offset);
+        case OP_SET_GLOBAL_SLOT:
+            return shortInstruction("OP_SET_GLOBAL_SLOT", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantValueInstruction16("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantValueInstruction16("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantValueInstruction16("OP_DEFINE_GLOBAL", chunk, offset);
+            return shortInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_SUPER:
             return constantValueInstruction16("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL: return simpleInstruction("OP_EQUAL", offset);
@@ -143,8 +181,10 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
-            return invokeInstruction("OP_INVOKE", chunk, offset);
+            return invokeCachedInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
@@ -174,6 +214,47 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantValueInstruction16("OP_METHOD", chunk, offset);
+        case OP_ADD_LOCALS:
+            return fusedLocalsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_LESS_JUMP:
+            return simpleInstruction("OP_LESS_JUMP", offset);
+        case OP_GREATER_JUMP:
+            return simpleInstruction("OP_GREATER_JUMP", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_ADD_STR:
+            return simpleInstruction("OP_ADD_STR", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_INDEX_GET:
+            return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return simpleInstruction("OP_INDEX_SET", offset);
+        case OP_ITER_INIT:
+            return simpleInstruction("OP_ITER_INIT", offset);
+        case OP_ITER_NEXT: {
+            uint8_t slot = chunk->code[offset + 1];
+            uint8_t count = chunk->code[offset + 2];
+            uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8 | chunk->code[offset + 4]);
+            printf("%-16s %4d %4d -> %d\n", "OP_ITER_NEXT", slot, count, offset + 5 + jump);
+            return offset + 5;
+        }
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;    
@@ -11,6 +11,7 @@
 #include "vm.h"
 #include "compiler.h"
 #include "coverage.h"
+#include "bytecode.h"
 
 static void repl() {
     char line[1024];
@@ -57,10 +58,68 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static bool hasExtension(const char* path, const char* extension) {
+    size_t length = strlen(path);
+    size_t extLength = strlen(extension);
+    return length >= extLength && strcmp(path + length - extLength, extension) == 0;
+}
+
+// O cache de bytecode fica ao lado do fonte: script.lox -> script.loxc.
+static char* cachePath(const char* path) {
+    size_t length = strlen(path);
+    char* cache = (char*)malloc(length + 2);
+    if (cache == NULL) {
+        fprintf(stderr, "Not enough memory.\n");
+        exit(74);
+    }
+    memcpy(cache, path, length);
+    cache[length] = 'c';
+    cache[length + 1] = '\0';
+    return cache;
+}
+
+static void compileOnly(const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    BytecodeKey key = bytecodeKey(path, source);
+    ObjFunction* function = compile(source);
     free(source);
+    if (function == NULL) exit(65);
+
+    char* cache = cachePath(path);
+    if (!saveBytecode(function, cache, &key)) {
+        fprintf(stderr, "Could not write bytecode file \"%s\".\n", cache);
+        free(cache);
+        exit(74);
+    }
+    free(cache);
+}
+
+static void runFile(const char* path) {
+    InterpretResult result;
+    if (hasExtension(path, ".loxc")) {
+        ObjFunction* function = loadBytecode(path, NULL);
+        if (function == NULL) {
+            fprintf(stderr, "Could not load bytecode file \"%s\".\n", path);
+            exit(74);
+        }
+        result = interpretFunction(function);
+    } else if (debugAstMode) {
+        char* source = readFile(path);
+        result = interpret(source);
+        free(source);
+    } else {
+        char* source = readFile(path);
+        BytecodeKey key = bytecodeKey(path, source);
+        char* cache = cachePath(path);
+        ObjFunction* function = loadBytecode(cache, &key);
+        if (function == NULL) {
+            function = compile(source);
+            if (function != NULL) saveBytecode(function, cache, &key);
+        }
+        free(cache);
+        free(source);
+        result = function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(function);
+    }
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
@@ -75,16 +134,37 @@ int main(int argc, const char* argv[]) {
     
     initVM();
 
-    if (argc <= 1) {
+    const char* path = NULL;
+    bool compileOnlyMode = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ast") == 0 || strcmp(argv[i], "-a") == 0) {
+            debugAstMode = 1;
+        } else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "-s") == 0) {
+            atexit(printVMStats);
+        } else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            vm.maxFrames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--gc-pause") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            vm.gcPauseBudget = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compile-only") == 0 || strcmp(argv[i], "-c") == 0) {
+            compileOnlyMode = true;
+        } else if (path == NULL && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: clox [--ast|-a] [--stats|-s] [--max-frames n] [--gc-pause us] [--compile-only|-c] [path]\n");
+            exit(64);
+        }
+    }
+
+    if (compileOnlyMode) {
+        if (path == NULL) {
+            fprintf(stderr, "--compile-only requires a source file.\n");
+            exit(64);
+        }
+        compileOnly(path);
+    } else if (path == NULL) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
-    } else if (argc == 3 && (strcmp(argv[1], "--ast") == 0 || strcmp(argv[1], "-a") == 0)) {
-        debugAstMode = 1;
-        runFile(argv[2]);
     } else {
-        fprintf(stderr, "Usage: clox [--ast|-a] [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
@@ -1,9 +1,13 @@
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
 #include "memory.h"
 #include "common.h"
 #include "vm.h"
 #include "compiler.h"
 #include "object.h"
+#include "slab.h"
 
 #ifdef DEBUG_LOG_GC
 #include <stdio.h>
@@ -11,6 +15,26 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes alocados entre duas coletas menores.
+#define GC_NURSERY_SIZE (1024 * 1024)
+// Bytes alocados entre duas fatias de uma coleta completa incremental, no
+// máximo e no mínimo.
+#define GC_SLICE_BYTES (64 * 1024)
+#define GC_MIN_SLICE_BYTES (4 * 1024)
+// Com orçamento de pausa, o berçário encolhe para a coleta menor (que é
+// atômica) caber aproximadamente no mesmo orçamento.
+#define GC_NURSERY_BYTES_PER_US 1024
+// Trabalho mínimo de uma fatia: um objeto a cada 8 bytes alocados desde a
+// anterior. Todo objeto ocupa mais de 16 bytes, então marcar os vivos e
+// varrer todos termina antes de o mutador alocar outro heap inteiro.
+#define GC_BYTES_PER_WORK 8
+// Intervalo entre fatias por µs de orçamento, escolhido para o trabalho
+// mínimo (~16 objetos por µs) caber no orçamento.
+#define GC_SLICE_BYTES_PER_US 128
+// Quantas vezes a marcação revisita as raízes antes de terminar de uma vez.
+#define GC_MAX_RESCANS 16
+// Objetos processados entre duas consultas ao relógio dentro de uma fatia.
+#define GC_CLOCK_INTERVAL 64
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
@@ -22,6 +46,33 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
             collectGarbage();
         }      
     }
+
+#ifndef NO_SLAB_ALLOCATOR
+    // Todo chamador informa o tamanho antigo, então o bloco é devolvido à
+    // mesma classe de onde saiu sem cabeçalho por alocação.
+    if (oldSize <= SLAB_MAX_SIZE || newSize <= SLAB_MAX_SIZE) {
+        if (pointer != NULL && oldSize > 0 && newSize > 0 && oldSize <= SLAB_MAX_SIZE &&
+            newSize <= SLAB_MAX_SIZE && SLAB_CLASS(oldSize) == SLAB_CLASS(newSize)) {
+            return pointer;
+        }
+
+        void* result = NULL;
+        if (newSize > 0) {
+            result = newSize <= SLAB_MAX_SIZE ? slabAllocate(newSize) : malloc(newSize);
+            if (result == NULL) exit(1);
+            if (pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        }
+        if (pointer != NULL) {
+            if (oldSize <= SLAB_MAX_SIZE) {
+                slabFree(pointer, oldSize);
+            } else {
+                free(pointer);
+            }
+        }
+        return result;
+    }
+#endif
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -32,9 +83,13 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+static void pushGray(Obj* object);
+
 void markObject(Obj* object) {
     if (object == NULL) return;
     if (object->isMarked) return;
+    // Na coleta menor a geração velha é tratada como viva e não é percorrida.
+    if (vm.minorGC && object->isOld) return;
 
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void*)object);
@@ -42,7 +97,10 @@ void markObject(Obj* object) {
     printf("\n");
 #endif
     object->isMarked = true;
+    pushGray(object);
+}
 
+static void pushGray(Obj* object) {
     if (vm.grayCapacity < vm.grayCount + 1) {
         vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
         vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
@@ -57,6 +115,29 @@ void markValue(Value value) {
     if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
+bool isUnreachable(Obj* object) {
+    return !object->isMarked && !(vm.minorGC && object->isOld);
+}
+
+void rememberObject(Obj* object) {
+    // Durante a marcação, um dono já marcado que mudou em bloco volta a ser cinza.
+    if (vm.gcPhase == GC_MARK) {
+        if (object->isMarked) pushGray(object);
+        return;
+    }
+    if (!(object->isOld || object->isMarked) || object->isRemembered) return;
+    object->isRemembered = true;
+
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj**)realloc(vm.remembered, sizeof(Obj*) * vm.rememberedCapacity);
+
+        if (vm.remembered == NULL) exit(1);
+    }
+
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
 static void markArray(ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
         markValue(array->values[i]);
@@ -80,6 +161,9 @@ static void blackenObject(Obj* object) {
             ObjClass* klass = (ObjClass*)object;
             markObject((Obj*)klass->name);
             markTable(&klass->methods);
+            for (int i = 0; i < OPERATOR_COUNT; i++) {
+                markValue(klass->operators[i]);
+            }
             break;
         }
         case OBJ_CLOSURE: {
@@ -94,12 +178,35 @@ static void blackenObject(Obj* object) {
             ObjFunction* function = (ObjFunction*)object;
             markObject((Obj*)function->name);
             markArray(&function->chunk.constants);
+            for (int i = 0; i < function->chunk.cacheCount; i++) {
+                InlineCache* cache = &function->chunk.caches[i];
+                for (int j = 0; j < cache->count; j++) {
+                    markObject((Obj*)cache->entries[j].klass);
+                    markObject((Obj*)cache->entries[j].shape);
+                    markObject((Obj*)cache->entries[j].transition);
+                    markValue(cache->entries[j].method);
+                }
+            }
             break;
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            if (instance->shape != NULL) {
+                markObject((Obj*)instance->shape);
+                for (int i = 0; i < instance->shape->fieldCount; i++) {
+                    markValue(instance->fields[i]);
+                }
+            }
+            markTable(&instance->dictionary);
+            break;
+        }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            markObject((Obj*)shape->parent);
+            markObject((Obj*)shape->name);
+            markTable(&shape->slots);
+            markTable(&shape->transitions);
             break;
         }
         case OBJ_UPVALUE:
@@ -108,13 +215,40 @@ static void blackenObject(Obj* object) {
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
+        case OBJ_ROPE:
+            markObject((Obj*)((ObjRope*)object)->flat);
+            break;
+        case OBJ_STRING_VIEW:
+            markObject(((ObjStringView*)object)->parent);
+            markObject((Obj*)((ObjStringView*)object)->flat);
+            break;
         case OBJ_LIST: {
             ObjList* list = (ObjList*)object;
+            if (list->base != NULL) {
+                markObject((Obj*)list->base);
+                break;
+            }
             for (int i = 0; i < list->count; i++) {
                 markValue(list->values[i]);
             }
             break;
         }
+        case OBJ_DICT: {
+            ObjDict* dict = (ObjDict*)object;
+            for (int i = 0; i < dict->used; i++) {
+                markValue(dict->entries[i].key);
+                markValue(dict->entries[i].value);
+            }
+            break;
+        }
+        case OBJ_ENUM: {
+            ObjEnum* enumObj = (ObjEnum*)object;
+            markObject((Obj*)enumObj->name);
+            markTable(&enumObj->values);
+            break;
+        }
+        case OBJ_F64ARRAY:
+            break;
     }
 }
 
@@ -148,18 +282,24 @@ static void freeObject(Obj* object) {
         }
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+            freeTable(&instance->dictionary);
             FREE(ObjInstance, object);
             break;
         }
+        case OBJ_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            freeTable(&shape->slots);
+            freeTable(&shape->transitions);
+            FREE(ObjShape, object);
+            break;
+        }
         case OBJ_NATIVE: {
             FREE(ObjNative, object);
             break;
         }
         case OBJ_STRING: {
-            ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            reallocate(object, STRING_SIZE(((ObjString*)object)->length), 0);
             break;
         }
         case OBJ_UPVALUE: {
@@ -172,6 +312,36 @@ static void freeObject(Obj* object) {
             FREE(ObjList, object);
             break;
         }
+        case OBJ_DICT: {
+            ObjDict* dict = (ObjDict*)object;
+            FREE_ARRAY(DictEntry, dict->entries, dict->entryCapacity);
+            FREE_ARRAY(int32_t, dict->index, dict->indexCapacity);
+            FREE(ObjDict, object);
+            break;
+        }
+        case OBJ_ENUM: {
+            freeTable(&((ObjEnum*)object)->values);
+            FREE(ObjEnum, object);
+            break;
+        }
+        case OBJ_ROPE: {
+            RopeBuffer* buffer = ((ObjRope*)object)->buffer;
+            if (--buffer->refCount == 0) {
+                FREE_ARRAY(char, buffer->chars, buffer->capacity);
+                FREE(RopeBuffer, buffer);
+            }
+            FREE(ObjRope, object);
+            break;
+        }
+        case OBJ_STRING_VIEW:
+            FREE(ObjStringView, object);
+            break;
+        case OBJ_F64ARRAY: {
+            ObjF64Array* array = (ObjF64Array*)object;
+            FREE_ARRAY(double, array->values, array->count);
+            FREE(ObjF64Array, object);
+            break;
+        }
     }
 }
 
@@ -188,52 +358,227 @@ static void markRoots() {
         markObject((Obj*)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalNames);
+    markArray(&vm.globalValues);
     markCompilerRoots();
     markObject((Obj*)vm.initString);
+    markObject((Obj*)vm.toStringString);
+    markObject((Obj*)vm.emptyShape);
+    for (int i = 0; i < OPERATOR_COUNT; i++) {
+        markObject((Obj*)vm.operatorNames[i]);
+    }
+}
+
+static double gcNow() {
+#ifdef _WIN32
+    return (double)clock() * 1000000.0 / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1000000.0 + (double)now.tv_nsec / 1000.0;
+#endif
+}
+
+// Uma fatia da coleta completa. slice == NULL roda até o fim.
+typedef struct {
+    double deadline;
+    int minWork;    // objetos processados antes de o prazo valer
+    int work;
+} GCSlice;
+
+// O prazo só vale depois do trabalho mínimo: sem ele, um mutador que aloca
+// mais rápido do que a fatia processa impediria o ciclo de terminar.
+static bool sliceExpired(GCSlice* slice) {
+    return slice != NULL && slice->work >= slice->minWork && gcNow() >= slice->deadline;
 }
 
-static void traceReferences() {
+static bool sliceOver(GCSlice* slice) {
+    if (slice == NULL || ++slice->work % GC_CLOCK_INTERVAL != 0) return false;
+    return sliceExpired(slice);
+}
+
+static size_t nurserySize() {
+    if (vm.gcPauseBudget == 0) return GC_NURSERY_SIZE;
+    size_t size = (size_t)vm.gcPauseBudget * GC_NURSERY_BYTES_PER_US;
+    if (size < GC_SLICE_BYTES) return GC_SLICE_BYTES;
+    return size < GC_NURSERY_SIZE ? size : GC_NURSERY_SIZE;
+}
+
+static size_t sliceSize() {
+    size_t size = (size_t)vm.gcPauseBudget * GC_SLICE_BYTES_PER_US;
+    if (vm.gcPauseBudget == 0 || size > GC_SLICE_BYTES) return GC_SLICE_BYTES;
+    return size < GC_MIN_SLICE_BYTES ? GC_MIN_SLICE_BYTES : size;
+}
+
+static bool traceReferences(GCSlice* slice) {
     while (vm.grayCount > 0) {
         Obj* object = vm.grayStack[--vm.grayCount];
         blackenObject(object);
+        if (sliceOver(slice)) return vm.grayCount == 0;
+    }
+    return true;
+}
+
+// Na coleta menor, os objetos velhos que receberam referências para jovens
+// são percorridos como raízes extras.
+static void markRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        blackenObject(vm.remembered[i]);
     }
 }
 
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+static void clearRemembered() {
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+}
+
+// Libera os jovens mortos e promove os sobreviventes para a geração velha.
+// Strings mortas saem da tabela de internação uma a uma, para a coleta menor
+// não precisar percorrer a tabela inteira (que tem todas as strings velhas).
+static void sweepYoung() {
+    Obj* object = vm.youngObjects;
     while (object != NULL) {
+        Obj* next = object->next;
         if (object->isMarked) {
             object->isMarked = false;
-            previous = object;
-            object = object->next;
+            object->isOld = true;
+            object->next = vm.objects;
+            vm.objects = object;
         } else {
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                vm.objects = object;
-            }
+            if (object->type == OBJ_STRING) tableDelete(&vm.strings, (ObjString*)object);
+            freeObject(object);
+        }
+        object = next;
+    }
+    vm.youngObjects = NULL;
+}
+
+static void minorCollection() {
+    vm.minorGC = true;
+    markRoots();
+    markRemembered();
+    traceReferences(NULL);
 
-            freeObject(unreached);
+    // Depois da coleta não sobra nenhum jovem, então o remembered set zera.
+    clearRemembered();
+    sweepYoung();
+    vm.youngBytes = 0;
+    vm.minorGC = false;
+    vm.minorCollections++;
+}
+
+// Fim da marcação: as raízes mudaram sem barreira desde o início do ciclo,
+// então são remarcadas e o cinza é esvaziado de uma vez. As duas gerações
+// viram listas a varrer; o que for alocado daqui em diante nasce numa lista
+// jovem nova e não é tocado pela varredura.
+static void finishMarking() {
+    markRoots();
+    traceReferences(NULL);
+    tableRemoveWhite(&vm.strings);
+    clearRemembered();
+
+    vm.unsweptYoung = vm.youngObjects;
+    vm.unsweptOld = vm.objects;
+    vm.youngObjects = NULL;
+    vm.youngBytes = 0;
+    vm.objects = NULL;
+    vm.gcPhase = GC_SWEEP;
+}
+
+static bool sweepSome(GCSlice* slice) {
+    for (;;) {
+        Obj** list = vm.unsweptYoung != NULL ? &vm.unsweptYoung : &vm.unsweptOld;
+        Obj* object = *list;
+        if (object == NULL) return true;
+        *list = object->next;
+
+        if (object->isMarked) {
+            object->isMarked = false;
+            object->isOld = true;
+            object->next = vm.objects;
+            vm.objects = object;
+        } else {
+            freeObject(object);
+        }
+        if (sliceOver(slice)) return vm.unsweptYoung == NULL && vm.unsweptOld == NULL;
+    }
+}
+
+// Uma fatia da coleta completa. Sem orçamento de pausa o ciclo inteiro roda
+// de uma vez, como uma coleta parada tradicional. O que o mutador alocou
+// desde a fatia anterior define o trabalho mínimo desta.
+static void fullCollectionStep(double start) {
+    size_t minWork = vm.gcDebt / GC_BYTES_PER_WORK;
+    GCSlice budget = {start + vm.gcPauseBudget, minWork < INT_MAX ? (int)minWork : INT_MAX, 0};
+    GCSlice* slice = vm.gcPauseBudget > 0 ? &budget : NULL;
+    vm.gcDebt = 0;
+    vm.gcSlices++;
+
+    // Objetos novos nascem brancos e só são achados pelas raízes. Enquanto a
+    // revisita das raízes ainda encontra trabalho, ele é feito em fatias; só
+    // a última revisita, com o cinza já vazio, roda de forma atômica.
+    while (vm.gcPhase == GC_MARK && traceReferences(slice)) {
+        markRoots();
+        if (vm.grayCount == 0 || ++vm.gcRescans >= GC_MAX_RESCANS) {
+            finishMarking();
+        } else if (sliceExpired(slice)) {
+            break;
+        }
+    }
+    if (vm.gcPhase == GC_SWEEP && sweepSome(slice)) {
+        vm.gcPhase = GC_IDLE;
+        vm.fullCollections++;
+        vm.nextFullGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+        if (vm.nextFullGC < vm.bytesAllocated + GC_NURSERY_SIZE) {
+            vm.nextFullGC = vm.bytesAllocated + GC_NURSERY_SIZE;
         }
     }
 }
 
 void collectGarbage() {
+    double start = gcNow();
+    size_t allocated = vm.bytesAllocated > vm.bytesAtLastGC ? vm.bytesAllocated - vm.bytesAtLastGC : 0;
+    if (vm.gcPhase != GC_IDLE) vm.gcDebt += allocated;
+    vm.youngBytes += allocated;
+    bool runSlice = true;
+
 #ifdef DEBUG_LOG_GC
-    printf("-- gc begin\n");
+    printf("-- gc begin (phase %d)\n", vm.gcPhase);
     size_t before = vm.bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    if (vm.gcPhase == GC_IDLE) {
+        bool full = vm.bytesAllocated > vm.nextFullGC;
+#ifdef DEBUG_STRESS_GC
+        // Alterna coletas menores e completas para exercitar os dois caminhos.
+        if (vm.minorCollections > vm.fullCollections) full = true;
+#endif
+        if (full) {
+            // O ciclo completo marca as duas gerações a partir das raízes; o
+            // remembered set só volta a valer depois da remarcação.
+            vm.gcPhase = GC_MARK;
+            vm.gcRescans = 0;
+            markRoots();
+        } else {
+            minorCollection();
+        }
+    } else if (vm.gcPhase == GC_SWEEP && vm.youngBytes >= nurserySize()) {
+        // Na varredura os sobreviventes já estão marcados e a coleta menor só
+        // olha para a lista jovem nova. Ela é uma pausa própria, no lugar da
+        // fatia, para as duas não dividirem o mesmo orçamento.
+        minorCollection();
+        runSlice = false;
+    }
+    // Durante a marcação não há coletas menores: cada gatilho vira mais uma fatia.
+    if (vm.gcPhase != GC_IDLE && runSlice) fullCollectionStep(start);
+
+    vm.bytesAtLastGC = vm.bytesAllocated;
+    vm.nextGC = vm.bytesAllocated + (vm.gcPhase != GC_IDLE ? sliceSize() : nurserySize());
 
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    double pause = gcNow() - start;
+    if (pause > vm.gcMaxPause) vm.gcMaxPause = pause;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
@@ -241,13 +586,28 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+static void freeList(Obj* object) {
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+}
+
+void freeObjects() {
+    freeList(vm.objects);
+    freeList(vm.youngObjects);
+    freeList(vm.unsweptYoung);
+    freeList(vm.unsweptOld);
+    vm.objects = NULL;
+    vm.youngObjects = NULL;
+    vm.unsweptYoung = NULL;
+    vm.unsweptOld = NULL;
+    vm.gcPhase = GC_IDLE;
 
     free(vm.grayStack);
+    free(vm.remembered);
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -22,7 +23,25 @@
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void markObject(Obj* obj);
 void markValue(Value value);
+bool isUnreachable(Obj* object);
+void rememberObject(Obj* object);
 void collectGarbage();
 void freeObjects();
 
+// Write barrier, chamada depois de guardar value dentro de owner.
+// Durante a marcação incremental, um objeto já marcado não pode passar a
+// apontar para um branco: o alvo é marcado na hora. Fora dela, guardar um
+// jovem num objeto velho (ou que vai sobreviver à varredura em andamento)
+// coloca o dono no remembered set, que serve de raiz na coleta menor.
+static inline void writeBarrier(Obj* owner, Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* target = AS_OBJ(value);
+    if (vm.gcPhase == GC_MARK) {
+        if (owner->isMarked && !target->isMarked) markObject(target);
+    } else if ((owner->isOld || owner->isMarked) && !owner->isRemembered &&
+               !target->isOld && !target->isMarked) {
+        rememberObject(owner);
+    }
+}
+
 #endif
\ No newline at end of file
@@ -9,12 +9,19 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+static void initObject(Obj* object, ObjType type) {
     object->type = type;
     object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    object->isOld = false;
+    object->isRemembered = false;
+    object->next = vm.youngObjects;
+    vm.youngObjects = object;
+
+}
+
+static Obj* allocateObject(size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    initObject(object, type);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -34,6 +41,10 @@ ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
+    for (int i = 0; i < OPERATOR_COUNT; i++) {
+        klass->operators[i] = NIL_VAL;
+    }
+    klass->fieldHint = 0;
     return klass;
 }
 
@@ -54,6 +65,7 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxStack = 0;
     function->name = NULL;
     initChunk(&function->chunk);
     return function;
@@ -62,10 +74,135 @@ ObjFunction* newFunction() {
 ObjInstance* newInstance(ObjClass* klass) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm.emptyShape;
+    instance->fieldCapacity = 0;
+    instance->fields = NULL;
+    initTable(&instance->dictionary);
+
+    // Reserva de uma vez o número de campos que instâncias anteriores da classe usaram.
+    if (klass->fieldHint > 0) {
+        push(OBJ_VAL(instance));
+        instance->fields = ALLOCATE(Value, klass->fieldHint);
+        instance->fieldCapacity = klass->fieldHint;
+        pop();
+    }
     return instance;
 }
 
+ObjShape* newShape(ObjShape* parent) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = NULL;
+    shape->fieldCount = parent != NULL ? parent->fieldCount : 0;
+    shape->lookups = 0;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    return shape;
+}
+
+static void indexShape(ObjShape* shape) {
+    for (ObjShape* field = shape; field->name != NULL; field = field->parent) {
+        tableSet(&shape->slots, field->name, NUMBER_VAL(field->fieldCount - 1));
+        writeBarrier((Obj*)shape, OBJ_VAL(field->name));
+    }
+}
+
+// Pode alocar (índice das shapes longas): a instância dona da shape precisa
+// estar alcançável pelo GC.
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    if (shape->slots.count == 0 && shape->fieldCount > SHAPE_INDEX_FIELDS &&
+        ++shape->lookups > SHAPE_INDEX_LOOKUPS) {
+        indexShape(shape);
+    }
+    if (shape->slots.count > 0) {
+        Value slot;
+        if (!tableGet(&shape->slots, name, &slot)) return -1;
+        return (int)AS_NUMBER(slot);
+    }
+    for (; shape->name != NULL; shape = shape->parent) {
+        if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+}
+
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+    ObjShape* child = newShape(shape);
+    push(OBJ_VAL(child));
+    child->name = name;
+    writeBarrier((Obj*)child, OBJ_VAL(name));
+    child->fieldCount++;
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    writeBarrier((Obj*)shape, OBJ_VAL(name));
+    writeBarrier((Obj*)shape, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+static void toDictionaryMode(ObjInstance* instance) {
+    for (ObjShape* field = instance->shape; field->name != NULL; field = field->parent) {
+        tableSet(&instance->dictionary, field->name, instance->fields[field->fieldCount - 1]);
+    }
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    instance->fields = NULL;
+    instance->fieldCapacity = 0;
+    instance->shape = NULL;
+    rememberObject((Obj*)instance);
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->dictionary, name, value);
+    }
+    int slot = shapeSlot(instance->shape, name);
+    if (slot < 0) return false;
+    *value = instance->fields[slot];
+    return true;
+}
+
+// A instância e o valor precisam estar alcançáveis pelo GC (na pilha da VM).
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+    if (instance->shape == NULL) {
+        tableSet(&instance->dictionary, name, value);
+        writeBarrier((Obj*)instance, OBJ_VAL(name));
+        writeBarrier((Obj*)instance, value);
+        return;
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot >= 0) {
+        instance->fields[slot] = value;
+        writeBarrier((Obj*)instance, value);
+        return;
+    }
+
+    if (instance->shape->fieldCount >= SHAPE_MAX_FIELDS) {
+        toDictionaryMode(instance);
+        tableSet(&instance->dictionary, name, value);
+        writeBarrier((Obj*)instance, OBJ_VAL(name));
+        writeBarrier((Obj*)instance, value);
+        return;
+    }
+
+    ObjShape* next = shapeTransition(instance->shape, name);
+    slot = next->fieldCount - 1;
+    if (slot >= instance->fieldCapacity) {
+        int oldCapacity = instance->fieldCapacity;
+        instance->fieldCapacity = GROW_CAPACITY(oldCapacity);
+        instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, instance->fieldCapacity);
+    }
+    instance->fields[slot] = value;
+    instance->shape = next;
+    writeBarrier((Obj*)instance, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(next));
+
+    if (instance->klass->fieldHint < next->fieldCount) {
+        instance->klass->fieldHint = next->fieldCount;
+    }
+}
+
 ObjNative* newNative(NativeFn function, int argCount) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
@@ -73,17 +210,6 @@ ObjNative* newNative(NativeFn function, int argCount) {
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
-    return string;
-}
-
 static uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
@@ -93,16 +219,39 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+static ObjString* internString(ObjString* string, uint32_t hash) {
+    initObject((Obj*)string, OBJ_STRING);
+    string->hash = hash;
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void*)string, STRING_SIZE(string->length), OBJ_STRING);
+#endif
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+// Reserva uma string de length caracteres para o chamador preencher. Ela
+// ainda não está no heap do GC nem internada: o chamador não pode alocar
+// nada antes de entregá-la a takeString().
+ObjString* allocateString(int length) {
+    ObjString* string = (ObjString*)reallocate(NULL, 0, STRING_SIZE(length));
+    string->length = length;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Interna uma string vinda de allocateString(). Se já existe uma igual, a
+// nova é liberada e a existente é devolvida.
+ObjString* takeString(ObjString* string) {
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars, string->length, hash);
 
     if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1);
+        reallocate(string, STRING_SIZE(string->length), 0);
         return interned;
     }
-
-    return allocateString(chars, length, hash);
+    return internString(string, hash);
 }
 
 ObjString* copyString(const char* chars, int length) {
@@ -111,10 +260,9 @@ ObjString* copyString(const char* chars, int length) {
 
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, hash);
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -148,30 +296,35 @@ void printObject(FILE* file, Value value) {
         case OBJ_FUNCTION:
             printFunction(file, AS_FUNCTION(value));
             break;
-        case OBJ_INSTANCE: {
-            Value str = valueToString(value);
-            if (IS_STRING(str)) {
-                fprintf(file, "%s", AS_CSTRING(str));
-            } else {
-                ObjInstance* instance = AS_INSTANCE(value);
-                fprintf(file, "%s instance", instance->klass->name->chars);
-            }
+        case OBJ_INSTANCE:
+            fprintf(file, "%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
-        }
         case OBJ_NATIVE:
             fprintf(file, "<native fn>");
             break;
         case OBJ_STRING:
             fprintf(file, "%s", AS_CSTRING(value));
             break;
+        case OBJ_ROPE:
+            fwrite(AS_ROPE(value)->buffer->chars, 1, (size_t)AS_ROPE(value)->length, file);
+            break;
+        case OBJ_STRING_VIEW: {
+            int length;
+            const char* chars = stringContents(value, &length);
+            fwrite(chars, 1, (size_t)length, file);
+            break;
+        }
         case OBJ_UPVALUE:
             fprintf(file, "upvalue");
             break;
+        case OBJ_SHAPE:
+            fprintf(file, "shape");
+            break;
         case OBJ_LIST: {
             ObjList* list = AS_LIST(value);
             fprintf(file, "[");
             for (int i = 0; i < list->count; i++) {
-                printValue(file, list->values[i]);
+                printValue(file, listValues(list)[i]);
                 if (i < list->count - 1) fprintf(file, ", ");
             }
             fprintf(file, "]");
@@ -181,15 +334,14 @@ void printObject(FILE* file, Value value) {
             ObjDict* dict = AS_DICT(value);
             fprintf(file, "{");
             bool first = true;
-            for (int i = 0; i < dict->entries.capacity; i++) {
-                Entry* entry = &dict->entries.entries[i];
-                if (entry->key != NULL) {
-                    if (!first) fprintf(file, ", ");
-                    printValue(file, OBJ_VAL(entry->key));
-                    fprintf(file, ": ");
-                    printValue(file, entry->value);
-                    first = false;
-                }
+            for (int i = 0; i < dict->used; i++) {
+                DictEntry* entry = &dict->entries[i];
+                if (IS_UNDEFINED(entry->key)) continue;
+                if (!first) fprintf(file, ", ");
+                printValue(file, entry->key);
+                fprintf(file, ": ");
+                printValue(file, entry->value);
+                first = false;
             }
             fprintf(file, "}");
             break;
@@ -199,6 +351,17 @@ void printObject(FILE* file, Value value) {
             fprintf(file, "%s enum", enumObj->name->chars);
             break;
         }
+        case OBJ_F64ARRAY: {
+            ObjF64Array* array = AS_F64ARRAY(value);
+            fprintf(file, "f64[");
+            for (int i = 0; i < array->count; i++) {
+                char number[32];
+                formatNumber(number, sizeof(number), array->values[i]);
+                fprintf(file, i < array->count - 1 ? "%s, " : "%s", number);
+            }
+            fprintf(file, "]");
+            break;
+        }
     }
 }
 
@@ -207,70 +370,265 @@ ObjList* newList() {
     list->count = 0;
     list->capacity = 0;
     list->values = NULL;
+    list->base = NULL;
+    list->start = 0;
+    return list;
+}
+
+// Lista já no tamanho final com uma cópia de values, que precisa estar
+// alcançável pelo GC (na pilha da VM, por exemplo).
+ObjList* newListFrom(Value* values, int count) {
+    Value* array = count > 0 ? ALLOCATE(Value, count) : NULL;
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    list->count = count;
+    list->capacity = count;
+    list->values = array;
+    list->base = NULL;
+    list->start = 0;
+    for (int i = 0; i < count; i++) {
+        list->values[i] = values[i];
+        writeBarrier((Obj*)list, values[i]);
+    }
     return list;
 }
 
+// Fatia [start, end) de list, sem copiar os valores.
+ObjList* newListSlice(ObjList* list, int start, int end) {
+    ObjList* slice = newList();
+    slice->base = list->base == NULL ? list : list->base;
+    slice->start = list->start + start;
+    slice->count = end - start;
+    writeBarrier((Obj*)slice, OBJ_VAL(slice->base));
+    return slice;
+}
+
+// Dá à fatia uma cópia própria dos valores; toda escrita passa por aqui.
+void listDetach(ObjList* list) {
+    if (list->base == NULL) return;
+    Value* array = list->count > 0 ? ALLOCATE(Value, list->count) : NULL;
+    Value* values = listValues(list);
+    for (int i = 0; i < list->count; i++) {
+        array[i] = values[i];
+        writeBarrier((Obj*)list, values[i]);
+    }
+    list->values = array;
+    list->capacity = list->count;
+    list->base = NULL;
+    list->start = 0;
+}
+
 void listAppend(ObjList* list, Value value) {
+    listDetach(list);
     if (list->capacity < list->count + 1) {
         int oldCapacity = list->capacity;
         list->capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
         list->values = (Value*)reallocate(list->values, sizeof(Value) * oldCapacity, sizeof(Value) * list->capacity);
     }
     list->values[list->count++] = value;
+    writeBarrier((Obj*)list, value);
 }
 
 Value listGet(ObjList* list, int index) {
     if (index < 0 || index >= list->count) return NIL_VAL;
-    return list->values[index];
+    return listValues(list)[index];
 }
 
 void listSet(ObjList* list, int index, Value value) {
     if (index < 0 || index >= list->count) return;
+    listDetach(list);
     list->values[index] = value;
+    writeBarrier((Obj*)list, value);
 }
 
 int listLength(ObjList* list) {
     return list->count;
 }
 
+#define DICT_SLOT_EMPTY   (-1)
+#define DICT_SLOT_DELETED (-2)
+#define DICT_MIN_INDEX 8
+// Carga máxima do índice: 2/3. As entradas têm exatamente essa capacidade.
+#define DICT_USABLE(indexCapacity) ((indexCapacity) * 2 / 3)
+// Abaixo disso não vale a pena compactar as entradas apagadas.
+#define DICT_MIN_COMPACT 16
+
 ObjDict* newDict() {
     ObjDict* dict = ALLOCATE_OBJ(ObjDict, OBJ_DICT);
-    initTable(&dict->entries);
+    dict->count = 0;
+    dict->used = 0;
+    dict->entryCapacity = 0;
+    dict->entries = NULL;
+    dict->version = 0;
+    dict->indexCapacity = 0;
+    dict->index = NULL;
     return dict;
 }
 
-void dictSet(ObjDict* dict, Value key, Value value) {
-    if (!IS_STRING(key)) return;
-    tableSet(&dict->entries, AS_STRING(key), value);
+// Procura key no índice; found recebe o slot ou -1. Só chaves instância
+// chamam código Lox (__eq__), e só elas podem falhar.
+static bool dictFindSlot(ObjDict* dict, Value key, uint32_t hash, int* found) {
+    *found = -1;
+    for (;;) {
+        if (dict->count == 0) return true;
+        uint32_t mask = (uint32_t)dict->indexCapacity - 1;
+        bool restart = false;
+        for (uint32_t slot = hash & mask; !restart; slot = (slot + 1) & mask) {
+            int32_t position = dict->index[slot];
+            if (position == DICT_SLOT_EMPTY) return true;
+            if (position == DICT_SLOT_DELETED) continue;
+
+            DictEntry* entry = &dict->entries[position];
+            if (entry->hash != hash) continue;
+            if (valuesEqual(entry->key, key)) {
+                *found = (int)slot;
+                return true;
+            }
+            if (!IS_INSTANCE(key) && !IS_INSTANCE(entry->key)) continue;
+
+            DictEntry* entries = dict->entries;
+            bool equal;
+            if (!keysEqual(key, entry->key, &equal)) return false;
+            // O __eq__ pode ter mexido no dicionário; nesse caso recomeça.
+            if (dict->entries != entries || dict->index[slot] != position) {
+                restart = true;
+            } else if (equal) {
+                *found = (int)slot;
+                return true;
+            }
+        }
+    }
+}
+
+static void dictInsertIndex(int32_t* index, int indexCapacity, uint32_t hash, int32_t position) {
+    uint32_t mask = (uint32_t)indexCapacity - 1;
+    uint32_t slot = hash & mask;
+    while (index[slot] != DICT_SLOT_EMPTY) slot = (slot + 1) & mask;
+    index[slot] = position;
 }
 
-Value dictGet(ObjDict* dict, Value key) {
-    if (!IS_STRING(key)) return NIL_VAL;
-    Value value;
-    if (tableGet(&dict->entries, AS_STRING(key), &value)) {
-        return value;
+// Reconstrói índice e entradas com espaço para pelo menos minUsable entradas,
+// descartando as apagadas. Serve para crescer, compactar e encolher.
+static void dictResize(ObjDict* dict, int minUsable) {
+    int indexCapacity = DICT_MIN_INDEX;
+    while (DICT_USABLE(indexCapacity) < minUsable) indexCapacity *= 2;
+    int entryCapacity = DICT_USABLE(indexCapacity);
+
+    // As novas áreas são alocadas antes de mexer no dicionário: a alocação
+    // pode disparar o GC, que ainda percorre as entradas antigas.
+    DictEntry* entries = ALLOCATE(DictEntry, entryCapacity);
+    int32_t* index = ALLOCATE(int32_t, indexCapacity);
+    for (int i = 0; i < indexCapacity; i++) index[i] = DICT_SLOT_EMPTY;
+
+    int count = 0;
+    for (int i = 0; i < dict->used; i++) {
+        DictEntry* entry = &dict->entries[i];
+        if (IS_UNDEFINED(entry->key)) continue;
+        entries[count] = *entry;
+        dictInsertIndex(index, indexCapacity, entry->hash, count);
+        count++;
     }
-    return NIL_VAL;
+
+    FREE_ARRAY(DictEntry, dict->entries, dict->entryCapacity);
+    FREE_ARRAY(int32_t, dict->index, dict->indexCapacity);
+    dict->entries = entries;
+    dict->entryCapacity = entryCapacity;
+    dict->index = index;
+    dict->indexCapacity = indexCapacity;
+    dict->count = count;
+    dict->used = count;
+    dict->version++;
 }
 
-bool dictDelete(ObjDict* dict, Value key) {
-    if (!IS_STRING(key)) return false;
-    return tableDelete(&dict->entries, AS_STRING(key));
+// Chaves string são comparadas pelo ponteiro da ObjString internada, então
+// cordas e fatias viram ObjString antes do hash.
+static Value dictKey(Value key) {
+    return IS_STRING_LIKE(key) && !IS_STRING(key) ? OBJ_VAL(flattenString(key)) : key;
+}
+
+bool dictSet(ObjDict* dict, Value key, Value value) {
+    key = dictKey(key);
+    uint32_t hash;
+    int slot;
+    if (!hashValue(key, &hash) || !dictFindSlot(dict, key, hash, &slot)) return false;
+    if (slot >= 0) {
+        dict->entries[dict->index[slot]].value = value;
+    } else {
+        // Entradas cheias: compacta e, se ainda faltar espaço, dobra.
+        if (dict->used + 1 > dict->entryCapacity) dictResize(dict, (dict->count + 1) * 2);
+        DictEntry* entry = &dict->entries[dict->used];
+        entry->key = key;
+        entry->value = value;
+        entry->hash = hash;
+        dictInsertIndex(dict->index, dict->indexCapacity, hash, dict->used);
+        dict->used++;
+        dict->count++;
+    }
+    writeBarrier((Obj*)dict, key);
+    writeBarrier((Obj*)dict, value);
+    return true;
+}
+
+bool dictGet(ObjDict* dict, Value key, Value* value) {
+    key = dictKey(key);
+    uint32_t hash;
+    int slot;
+    if (!hashValue(key, &hash) || !dictFindSlot(dict, key, hash, &slot)) return false;
+    *value = slot < 0 ? NIL_VAL : dict->entries[dict->index[slot]].value;
+    return true;
+}
+
+bool dictDelete(ObjDict* dict, Value key, bool* deleted) {
+    key = dictKey(key);
+    uint32_t hash;
+    int slot;
+    *deleted = false;
+    if (!hashValue(key, &hash) || !dictFindSlot(dict, key, hash, &slot)) return false;
+    if (slot < 0) return true;
+
+    DictEntry* entry = &dict->entries[dict->index[slot]];
+    entry->key = UNDEFINED_VAL;
+    entry->value = NIL_VAL;
+    dict->index[slot] = DICT_SLOT_DELETED;
+    dict->count--;
+    *deleted = true;
+
+    // Mais buracos que entradas vivas: compacta, o que também encolhe o
+    // índice quando o dicionário esvaziou.
+    if (dict->used >= DICT_MIN_COMPACT && dict->used - dict->count > dict->count) {
+        dictResize(dict, dict->count * 2);
+    }
+    return true;
 }
 
 int dictLength(ObjDict* dict) {
-    return dict->entries.count;
+    return dict->count;
+}
+
+// Zerado. Os valores são alocados antes do objeto, para o GC nunca ver um
+// array sem dados.
+ObjF64Array* newF64Array(int count) {
+    double* values = count > 0 ? ALLOCATE(double, count) : NULL;
+    for (int i = 0; i < count; i++) values[i] = 0;
+    ObjF64Array* array = ALLOCATE_OBJ(ObjF64Array, OBJ_F64ARRAY);
+    array->count = count;
+    array->values = values;
+    return array;
 }
 
 ObjEnum* newEnum(ObjString* name) {
     ObjEnum* enumObj = ALLOCATE_OBJ(ObjEnum, OBJ_ENUM);
     enumObj->name = name;
     initTable(&enumObj->values);
+    enumObj->version = 0;
     return enumObj;
 }
 
 void enumAddValue(ObjEnum* enumObj, ObjString* name, Value value) {
+    int capacity = enumObj->values.capacity;
     tableSet(&enumObj->values, name, value);
+    if (enumObj->values.capacity != capacity) enumObj->version++;
+    writeBarrier((Obj*)enumObj, OBJ_VAL(name));
+    writeBarrier((Obj*)enumObj, value);
 }
 
 Value enumGetValue(ObjEnum* enumObj, ObjString* name) {
@@ -285,3 +643,100 @@ int enumLength(ObjEnum* enumObj) {
     return enumObj->values.count;
 }
 
+RopeBuffer* newRopeBuffer(int capacity) {
+    RopeBuffer* buffer = ALLOCATE(RopeBuffer, 1);
+    buffer->refCount = 0;
+    buffer->count = 0;
+    buffer->capacity = 0;
+    buffer->chars = NULL;
+    growRopeBuffer(buffer, capacity);
+    return buffer;
+}
+
+void growRopeBuffer(RopeBuffer* buffer, int capacity) {
+    buffer->chars = GROW_ARRAY(char, buffer->chars, buffer->capacity, capacity);
+    buffer->capacity = capacity;
+}
+
+ObjRope* newRope(RopeBuffer* buffer, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->buffer = buffer;
+    rope->flat = NULL;
+    buffer->refCount++;
+    return rope;
+}
+
+// A corda precisa estar alcançável pelo GC: a string internada é alocada aqui.
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat == NULL) {
+        rope->flat = copyString(rope->buffer->chars, rope->length);
+        writeBarrier((Obj*)rope, OBJ_VAL(rope->flat));
+    }
+    return rope->flat;
+}
+
+// Fatias curtas viram strings internadas; as longas, ObjStringView sobre
+// o pai da fatia (string precisa estar alcançável pelo GC).
+Value newSubstring(Value string, int start, int end) {
+    int length;
+    const char* chars = stringContents(string, &length);
+    if (end - start < STRING_VIEW_MIN_LENGTH) {
+        return OBJ_VAL(copyString(chars + start, end - start));
+    }
+    if (IS_STRING_VIEW(string)) {
+        start += AS_STRING_VIEW(string)->start;
+        end += AS_STRING_VIEW(string)->start;
+        string = OBJ_VAL(AS_STRING_VIEW(string)->parent);
+    }
+    ObjStringView* view = ALLOCATE_OBJ(ObjStringView, OBJ_STRING_VIEW);
+    view->parent = AS_OBJ(string);
+    view->start = start;
+    view->length = end - start;
+    view->flat = NULL;
+    writeBarrier((Obj*)view, string);
+    return OBJ_VAL(view);
+}
+
+// ObjString com o mesmo conteúdo de qualquer valor string (ou corda, ou
+// fatia), que precisa estar alcançável pelo GC.
+ObjString* flattenString(Value value) {
+    if (IS_ROPE(value)) return flattenRope(AS_ROPE(value));
+    if (IS_STRING_VIEW(value)) {
+        ObjStringView* view = AS_STRING_VIEW(value);
+        if (view->flat == NULL) {
+            int length;
+            const char* chars = stringContents(value, &length);
+            view->flat = copyString(chars, length);
+            writeBarrier((Obj*)view, OBJ_VAL(view->flat));
+        }
+        return view->flat;
+    }
+    return AS_STRING(value);
+}
+
+const char* stringContents(Value value, int* length) {
+    if (IS_ROPE(value)) {
+        *length = AS_ROPE(value)->length;
+        return AS_ROPE(value)->buffer->chars;
+    }
+    if (IS_STRING_VIEW(value)) {
+        ObjStringView* view = AS_STRING_VIEW(value);
+        int parentLength;
+        const char* chars = stringContents(OBJ_VAL(view->parent), &parentLength);
+        *length = view->length;
+        return chars + view->start;
+    }
+    *length = AS_STRING(value)->length;
+    return AS_STRING(value)->chars;
+}
+
+// Igualdade de conteúdo sem alocar; duas ObjString internadas bastam
+// comparar o ponteiro.
+bool stringsEqual(Value a, Value b) {
+    if (IS_STRING(a) && IS_STRING(b)) return AS_STRING(a) == AS_STRING(b);
+    int aLength, bLength;
+    const char* aChars = stringContents(a, &aLength);
+    const char* bChars = stringContents(b, &bLength);
+    return aLength == bLength && memcmp(aChars, bChars, (size_t)aLength) == 0;
+}
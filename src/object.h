@@ -18,6 +18,11 @@
 #define IS_STRING(value)   isObjType(value, OBJ_STRING)
 #define IS_DICT(value)     isObjType(value, OBJ_DICT)
 #define IS_ENUM(value)     isObjType(value, OBJ_ENUM)
+#define IS_SHAPE(value)    isObjType(value, OBJ_SHAPE)
+#define IS_ROPE(value)     isObjType(value, OBJ_ROPE)
+#define IS_F64ARRAY(value) isObjType(value, OBJ_F64ARRAY)
+#define IS_STRING_VIEW(value) isObjType(value, OBJ_STRING_VIEW)
+#define IS_STRING_LIKE(value) (IS_STRING(value) || IS_ROPE(value) || IS_STRING_VIEW(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)    ((ObjClass*)AS_OBJ(value))
@@ -29,6 +34,20 @@
 #define AS_CSTRING(value)  (((ObjString*)AS_OBJ(value))->chars)
 #define AS_DICT(value)     ((ObjDict*)AS_OBJ(value))
 #define AS_ENUM(value)     ((ObjEnum*)AS_OBJ(value))
+#define AS_SHAPE(value)    ((ObjShape*)AS_OBJ(value))
+#define AS_ROPE(value)     ((ObjRope*)AS_OBJ(value))
+#define AS_F64ARRAY(value) ((ObjF64Array*)AS_OBJ(value))
+#define AS_STRING_VIEW(value) ((ObjStringView*)AS_OBJ(value))
+
+// Concatenações mais curtas que isso geram strings internadas normais.
+#define ROPE_MIN_LENGTH 32
+// Idem para substring(): fatias curtas são copiadas e internadas.
+#define STRING_VIEW_MIN_LENGTH 32
+
+// Acima disso a instância sai das shapes e passa a usar uma tabela própria.
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_INDEX_FIELDS 8
+#define SHAPE_INDEX_LOOKUPS 8
 
 typedef enum {
     OBJ_BOUND_METHOD,
@@ -41,12 +60,18 @@ typedef enum {
     OBJ_UPVALUE,
     OBJ_LIST,
     OBJ_DICT,
-    OBJ_ENUM
+    OBJ_ENUM,
+    OBJ_SHAPE,
+    OBJ_ROPE,
+    OBJ_F64ARRAY,
+    OBJ_STRING_VIEW
 } ObjType;
 
 struct Obj {
     ObjType type;
     bool isMarked;
+    bool isOld;          // sobreviveu a uma coleta e foi promovido
+    bool isRemembered;   // objeto velho no remembered set
     struct Obj* next;
 };
 
@@ -54,6 +79,7 @@ typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int maxStack;        // slots acima de frame->slots que o código usa
     Chunk chunk;
     ObjString* name;
 } ObjFunction;
@@ -66,13 +92,16 @@ typedef struct {
     int argCount;
 } ObjNative;
 
+// Os caracteres ficam no mesmo bloco do cabeçalho, terminados em '\0'.
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[];
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (size_t)(length) + 1)
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -87,16 +116,53 @@ typedef struct {
     int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+// Métodos especiais (sobrecarga de operador, __hash__, protocolo de
+// iteração), copiados para um slot fixo da classe em OP_METHOD/OP_INHERIT
+// para o despacho não precisar consultar a tabela.
+typedef enum {
+    OPERATOR_ADD,
+    OPERATOR_SUB,
+    OPERATOR_MUL,
+    OPERATOR_DIV,
+    OPERATOR_EQ,
+    OPERATOR_GT,
+    OPERATOR_LT,
+    OPERATOR_HASH,
+    OPERATOR_ITER,
+    OPERATOR_NEXT,
+    OPERATOR_COUNT
+} OperatorSlot;
+
+typedef struct ObjClass {
     Obj obj;
     ObjString* name;
     Table methods;
+    Value operators[OPERATOR_COUNT];
+    int fieldHint;
 } ObjClass;
 
+// Hidden class: instâncias que recebem os mesmos campos na mesma ordem
+// compartilham a shape, e cada campo vira um índice fixo no array de valores.
+// Cada shape guarda só o campo que acrescentou e a busca por nome sobe pelos
+// pais. Uma shape com mais de SHAPE_INDEX_FIELDS campos que continua sendo
+// buscada por nome (misses de inline cache) monta um índice completo em slots.
+typedef struct ObjShape {
+    Obj obj;
+    struct ObjShape* parent;
+    ObjString* name;     // campo acrescentado por esta shape; NULL na raiz
+    int fieldCount;      // o campo novo fica no slot fieldCount - 1
+    int lookups;         // buscas por nome antes de ter índice
+    Table slots;
+    Table transitions;
+} ObjShape;
+
 typedef struct {
     Obj obj;
     ObjClass* klass;
-    Table fields;
+    ObjShape* shape;     // NULL em modo dicionário
+    int fieldCapacity;
+    Value* fields;
+    Table dictionary;
 } ObjInstance;
 
 typedef struct {
@@ -105,52 +171,131 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
-typedef struct {
+// Uma fatia (slice) começa sem valores próprios e lê os de base a partir de
+// start, enxergando o que mudar lá; a primeira escrita nela faz a cópia
+// (listDetach). base é sempre uma lista comum, e listas nunca encolhem.
+typedef struct ObjList {
     Obj obj;
     int count;
     int capacity;
     Value* values;
+    struct ObjList* base;
+    int start;
 } ObjList;
 
+typedef struct {
+    Value key;          // UNDEFINED_VAL depois de apagada
+    Value value;
+    uint32_t hash;
+} DictEntry;
+
+// Dicionário compacto: as entradas ficam densas e em ordem de inserção, e o
+// índice (hash aberto, bem menor que as entradas) guarda só a posição de cada
+// uma. Percorrer custa o número de entradas, não a capacidade do índice.
 typedef struct {
     Obj obj;
-    Table entries;
+    int count;          // entradas vivas
+    int used;           // entradas ocupadas em entries, vivas ou apagadas
+    int entryCapacity;
+    DictEntry* entries;
+    int indexCapacity;  // potência de dois
+    int32_t* index;     // posição em entries, DICT_SLOT_EMPTY ou DICT_SLOT_DELETED
+    uint32_t version;   // muda quando as entradas mudam de posição
 } ObjDict;
 
 typedef struct {
     Obj obj;
     ObjString* name;
     Table values;
+    uint32_t version;   // muda quando a tabela é redimensionada
 } ObjEnum;
 
+// Array de tamanho fixo de doubles sem boxing, operado em lote pelos
+// kernels de simd.h.
+typedef struct {
+    Obj obj;
+    int count;
+    double* values;
+} ObjF64Array;
+
+// Buffer de anexação compartilhado pelas cordas de uma sequência s = s + x.
+// Cada corda enxerga só o prefixo [0, length); anexar à corda cujo length
+// é o count do buffer escreve no lugar, sem copiar o prefixo.
+typedef struct {
+    int refCount;
+    int count;
+    int capacity;
+    char* chars;
+} RopeBuffer;
+
+// Resultado de concatenação ainda não internado. Vira ObjString (flat) só
+// quando o conteúdo é usado como string: argumentos de nativas, chaves etc.
+typedef struct {
+    Obj obj;
+    int length;
+    RopeBuffer* buffer;
+    ObjString* flat;
+} ObjRope;
+
+// substring() longa: aponta para os caracteres de parent (ObjString ou
+// corda, nunca outra fatia) sem copiar. Como a corda, só vira ObjString
+// internada (flat) quando precisa de hash.
+typedef struct {
+    Obj obj;
+    Obj* parent;
+    int start;
+    int length;
+    ObjString* flat;
+} ObjStringView;
+
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjClass* klass);
+ObjShape* newShape(ObjShape* parent);
+int shapeSlot(ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
 ObjNative* newNative(NativeFn function, int argCount);
-ObjString* takeString(char* chars, int length);
+ObjString* allocateString(int length);
+ObjString* takeString(ObjString* string);
 ObjString* copyString(const char* chars, int length);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(FILE* file, Value value);
 ObjList* newList();
+ObjList* newListFrom(Value* values, int count);
+ObjList* newListSlice(ObjList* list, int start, int end);
+void listDetach(ObjList* list);
 void listAppend(ObjList* list, Value value);
 Value listGet(ObjList* list, int index);
 void listSet(ObjList* list, int index, Value value);
 int listLength(ObjList* list);
 ObjDict* newDict();
-void dictSet(ObjDict* dict, Value key, Value value);
-Value dictGet(ObjDict* dict, Value key);
-bool dictDelete(ObjDict* dict, Value key);
+bool dictSet(ObjDict* dict, Value key, Value value);
+bool dictGet(ObjDict* dict, Value key, Value* value);
+bool dictDelete(ObjDict* dict, Value key, bool* deleted);
 int dictLength(ObjDict* dict);
+ObjF64Array* newF64Array(int count);
 ObjEnum* newEnum(ObjString* name);
 void enumAddValue(ObjEnum* enumObj, ObjString* name, Value value);
 Value enumGetValue(ObjEnum* enumObj, ObjString* name);
 int enumLength(ObjEnum* enumObj);
+RopeBuffer* newRopeBuffer(int capacity);
+void growRopeBuffer(RopeBuffer* buffer, int capacity);
+ObjRope* newRope(RopeBuffer* buffer, int length);
+ObjString* flattenRope(ObjRope* rope);
+Value newSubstring(Value string, int start, int end);
+ObjString* flattenString(Value value);
+const char* stringContents(Value value, int* length);
+bool stringsEqual(Value a, Value b);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline Value* listValues(ObjList* list) {
+    return list->base == NULL ? list->values : list->base->values + list->start;
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "common.h"
+#include "chunk.h"
+#include "optimizer.h"
+
+// Peephole de superinstruções. A instrução fundida sobrescreve apenas o
+// opcode da primeira instrução da sequência; os bytes seguintes continuam no
+// lugar. Assim nenhum offset de salto muda, saltos para o meio da sequência
+// continuam válidos e o caminho lento (sobrecarga de operadores) só precisa
+// se comportar como a primeira instrução original e seguir adiante.
+
+static bool opcodeAt(Chunk* chunk, int offset, OpCode op) {
+    return offset < chunk->count && chunk->code[offset] == op;
+}
+
+static void fuseAt(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code;
+    int next = offset + instructionLength(chunk, offset);
+
+    switch (code[offset]) {
+        case OP_GET_LOCAL:
+            // GET_LOCAL a; GET_LOCAL b; ADD
+            if (opcodeAt(chunk, next, OP_GET_LOCAL) && opcodeAt(chunk, next + 2, OP_ADD)) {
+                code[offset] = OP_ADD_LOCALS;
+            }
+            break;
+        case OP_LESS:
+        case OP_GREATER:
+            // LESS; JUMP_IF_FALSE; POP
+            if (opcodeAt(chunk, next, OP_JUMP_IF_FALSE) && opcodeAt(chunk, next + 3, OP_POP)) {
+                code[offset] = code[offset] == OP_LESS ? OP_LESS_JUMP : OP_GREATER_JUMP;
+            } else if (opcodeAt(chunk, next, OP_NOT)) {
+                code[offset] = code[offset] == OP_LESS ? OP_GREATER_EQUAL : OP_LESS_EQUAL;
+            }
+            break;
+        case OP_EQUAL:
+            if (opcodeAt(chunk, next, OP_NOT)) {
+                code[offset] = OP_NOT_EQUAL;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void optimizeChunk(Chunk* chunk) {
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        fuseAt(chunk, offset);
+    }
+}
@@ -138,7 +138,14 @@ static TokenType identifierType() {
         case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
         case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
         case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
+        case 'i':
+            if (scanner.current - scanner.start == 2) {
+                switch (scanner.start[1]) {
+                    case 'f': return TOKEN_IF;
+                    case 'n': return TOKEN_IN;
+                }
+            }
+            break;
         case 'f': 
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
@@ -190,6 +197,8 @@ Token scanToken() {
         case ')': return makeToken(TOKEN_RIGHT_PAREN);
         case '{': return makeToken(TOKEN_LEFT_BRACE);
         case '}': return makeToken(TOKEN_RIGHT_BRACE);
+        case '[': return makeToken(TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(TOKEN_RIGHT_BRACKET);
         case ';': return makeToken(TOKEN_SEMICOLON);
         case ',': return makeToken(TOKEN_COMMA);
         case '.': return makeToken(TOKEN_DOT);
@@ -206,4 +215,12 @@ Token scanToken() {
     }
 
     return errorToken("Unexpected character.");
-}
\ No newline at end of file
+}
+
+// Próximo token sem consumi-lo, para o compilador distinguir "for (x in ...)".
+Token peekToken() {
+    Scanner saved = scanner;
+    Token token = scanToken();
+    scanner = saved;
+    return token;
+}
@@ -0,0 +1,362 @@
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+SimdKernels simd;
+
+static double sumScalar(const double* values, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += values[i];
+    return sum;
+}
+
+// min e max propagam NaN: com algum NaN no array, todas as variantes
+// devolvem o primeiro deles.
+static double minScalar(const double* values, int count) {
+    double min = values[0];
+    if (min != min) return min;
+    for (int i = 1; i < count; i++) {
+        if (values[i] < min) min = values[i];
+        else if (values[i] != values[i]) return values[i];
+    }
+    return min;
+}
+
+static double maxScalar(const double* values, int count) {
+    double max = values[0];
+    if (max != max) return max;
+    for (int i = 1; i < count; i++) {
+        if (values[i] > max) max = values[i];
+        else if (values[i] != values[i]) return values[i];
+    }
+    return max;
+}
+
+static double dotScalar(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static void axpyScalar(double alpha, const double* x, double* y, int count) {
+    for (int i = 0; i < count; i++) y[i] += alpha * x[i];
+}
+
+static void scaleScalar(double alpha, double* values, int count) {
+    for (int i = 0; i < count; i++) values[i] *= alpha;
+}
+
+static void addScalar(const double* a, const double* b, double* out, int count) {
+    for (int i = 0; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static void mulScalar(const double* a, const double* b, double* out, int count) {
+    for (int i = 0; i < count; i++) out[i] = a[i] * b[i];
+}
+
+static void prefixSumScalar(const double* values, double* out, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += values[i];
+        out[i] = sum;
+    }
+}
+
+#ifdef SIMD_X86
+
+// SSE2 faz parte do x86-64, mas em 32 bits também é escolhida em tempo de
+// execução; os atributos target dispensam flags de compilação.
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// _mm_min_pd/_mm_max_pd devolvem o segundo operando quando há NaN, então os
+// NaNs são acumulados à parte e, se houver algum, o primeiro é buscado.
+static double firstNaN(const double* values, int count) {
+    for (int i = 0; i < count; i++) {
+        if (values[i] != values[i]) return values[i];
+    }
+    return 0;
+}
+
+static TARGET_SSE2 double horizontalSum128(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static TARGET_SSE2 double sumSse2(const double* values, int count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(values + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(values + i + 2));
+    }
+    double sum = horizontalSum128(_mm_add_pd(acc0, acc1));
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+static TARGET_SSE2 double minSse2(const double* values, int count) {
+    if (count < 2) return values[0];
+    __m128d acc = _mm_loadu_pd(values);
+    __m128d nan = _mm_cmpunord_pd(acc, acc);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        acc = _mm_min_pd(acc, v);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    }
+    if (_mm_movemask_pd(nan) != 0) return firstNaN(values, i);
+    double min = _mm_cvtsd_f64(_mm_min_sd(acc, _mm_unpackhi_pd(acc, acc)));
+    for (; i < count; i++) {
+        if (values[i] < min) min = values[i];
+        else if (values[i] != values[i]) return values[i];
+    }
+    return min;
+}
+
+static TARGET_SSE2 double maxSse2(const double* values, int count) {
+    if (count < 2) return values[0];
+    __m128d acc = _mm_loadu_pd(values);
+    __m128d nan = _mm_cmpunord_pd(acc, acc);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_loadu_pd(values + i);
+        acc = _mm_max_pd(acc, v);
+        nan = _mm_or_pd(nan, _mm_cmpunord_pd(v, v));
+    }
+    if (_mm_movemask_pd(nan) != 0) return firstNaN(values, i);
+    double max = _mm_cvtsd_f64(_mm_max_sd(acc, _mm_unpackhi_pd(acc, acc)));
+    for (; i < count; i++) {
+        if (values[i] > max) max = values[i];
+        else if (values[i] != values[i]) return values[i];
+    }
+    return max;
+}
+
+static TARGET_SSE2 double dotSse2(const double* a, const double* b, int count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double sum = horizontalSum128(_mm_add_pd(acc0, acc1));
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static TARGET_SSE2 void axpySse2(double alpha, const double* x, double* y, int count) {
+    __m128d factor = _mm_set1_pd(alpha);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d product = _mm_mul_pd(factor, _mm_loadu_pd(x + i));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+    }
+    for (; i < count; i++) y[i] += alpha * x[i];
+}
+
+static TARGET_SSE2 void scaleSse2(double alpha, double* values, int count) {
+    __m128d factor = _mm_set1_pd(alpha);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(values + i, _mm_mul_pd(factor, _mm_loadu_pd(values + i)));
+    }
+    for (; i < count; i++) values[i] *= alpha;
+}
+
+static TARGET_SSE2 void addSse2(const double* a, const double* b, double* out, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static TARGET_SSE2 void mulSse2(const double* a, const double* b, double* out, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    for (; i < count; i++) out[i] = a[i] * b[i];
+}
+
+// Varredura de dois em dois: [a0, a0 + a1] mais o total acumulado até ali.
+// A versão AVX2 usa esta também.
+static TARGET_SSE2 void prefixSumSse2(const double* values, double* out, int count) {
+    __m128d carry = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d pair = _mm_loadu_pd(values + i);
+        pair = _mm_add_pd(pair, _mm_unpacklo_pd(_mm_setzero_pd(), pair));
+        pair = _mm_add_pd(pair, carry);
+        _mm_storeu_pd(out + i, pair);
+        carry = _mm_unpackhi_pd(pair, pair);
+    }
+    double sum = _mm_cvtsd_f64(carry);
+    for (; i < count; i++) {
+        sum += values[i];
+        out[i] = sum;
+    }
+}
+
+static TARGET_AVX2 double horizontalSum256(__m256d v) {
+    __m128d low = _mm256_castpd256_pd128(v);
+    __m128d high = _mm256_extractf128_pd(v, 1);
+    __m128d pair = _mm_add_pd(low, high);
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+static TARGET_AVX2 double sumAvx2(const double* values, int count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+    }
+    double sum = horizontalSum256(_mm256_add_pd(acc0, acc1));
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+static TARGET_AVX2 double minAvx2(const double* values, int count) {
+    if (count < 4) return minScalar(values, count);
+    __m256d acc = _mm256_loadu_pd(values);
+    __m256d nan = _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        acc = _mm256_min_pd(acc, v);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+    }
+    if (_mm256_movemask_pd(nan) != 0) return firstNaN(values, i);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double min = minScalar(lanes, 4);
+    for (; i < count; i++) {
+        if (values[i] < min) min = values[i];
+        else if (values[i] != values[i]) return values[i];
+    }
+    return min;
+}
+
+static TARGET_AVX2 double maxAvx2(const double* values, int count) {
+    if (count < 4) return maxScalar(values, count);
+    __m256d acc = _mm256_loadu_pd(values);
+    __m256d nan = _mm256_cmp_pd(acc, acc, _CMP_UNORD_Q);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_loadu_pd(values + i);
+        acc = _mm256_max_pd(acc, v);
+        nan = _mm256_or_pd(nan, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+    }
+    if (_mm256_movemask_pd(nan) != 0) return firstNaN(values, i);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double max = maxScalar(lanes, 4);
+    for (; i < count; i++) {
+        if (values[i] > max) max = values[i];
+        else if (values[i] != values[i]) return values[i];
+    }
+    return max;
+}
+
+static TARGET_AVX2 double dotAvx2(const double* a, const double* b, int count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double sum = horizontalSum256(_mm256_add_pd(acc0, acc1));
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static TARGET_AVX2 void axpyAvx2(double alpha, const double* x, double* y, int count) {
+    __m256d factor = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d product = _mm256_mul_pd(factor, _mm256_loadu_pd(x + i));
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+    }
+    for (; i < count; i++) y[i] += alpha * x[i];
+}
+
+static TARGET_AVX2 void scaleAvx2(double alpha, double* values, int count) {
+    __m256d factor = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(values + i, _mm256_mul_pd(factor, _mm256_loadu_pd(values + i)));
+    }
+    for (; i < count; i++) values[i] *= alpha;
+}
+
+static TARGET_AVX2 void addAvx2(const double* a, const double* b, double* out, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static TARGET_AVX2 void mulAvx2(const double* a, const double* b, double* out, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    }
+    for (; i < count; i++) out[i] = a[i] * b[i];
+}
+
+#endif
+
+void initSimd() {
+    simd = (SimdKernels){
+        .name = "scalar",
+        .sum = sumScalar,
+        .min = minScalar,
+        .max = maxScalar,
+        .dot = dotScalar,
+        .axpy = axpyScalar,
+        .scale = scaleScalar,
+        .add = addScalar,
+        .mul = mulScalar,
+        .prefixSum = prefixSumScalar,
+    };
+
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        simd = (SimdKernels){
+            .name = "avx2",
+            .sum = sumAvx2,
+            .min = minAvx2,
+            .max = maxAvx2,
+            .dot = dotAvx2,
+            .axpy = axpyAvx2,
+            .scale = scaleAvx2,
+            .add = addAvx2,
+            .mul = mulAvx2,
+            .prefixSum = prefixSumSse2,
+        };
+    } else if (__builtin_cpu_supports("sse2")) {
+        simd = (SimdKernels){
+            .name = "sse2",
+            .sum = sumSse2,
+            .min = minSse2,
+            .max = maxSse2,
+            .dot = dotSse2,
+            .axpy = axpySse2,
+            .scale = scaleSse2,
+            .add = addSse2,
+            .mul = mulSse2,
+            .prefixSum = prefixSumSse2,
+        };
+    }
+#endif
+}
@@ -0,0 +1,27 @@
+#ifndef clox_simd_h
+#define clox_simd_h
+
+#include "common.h"
+
+// Kernels em lote sobre arrays contíguos de double (OBJ_F64ARRAY). initSimd()
+// escolhe uma vez, conforme a CPU, entre as versões AVX2, SSE2 e escalar.
+// As versões vetoriais somam em outra ordem, então sum e dot podem diferir da
+// escalar no último bit.
+typedef struct {
+    const char* name;
+    double (*sum)(const double* values, int count);
+    double (*min)(const double* values, int count);     // count > 0
+    double (*max)(const double* values, int count);     // count > 0
+    double (*dot)(const double* a, const double* b, int count);
+    void (*axpy)(double alpha, const double* x, double* y, int count);   // y += alpha * x
+    void (*scale)(double alpha, double* values, int count);
+    void (*add)(const double* a, const double* b, double* out, int count);
+    void (*mul)(const double* a, const double* b, double* out, int count);
+    void (*prefixSum)(const double* values, double* out, int count);
+} SimdKernels;
+
+extern SimdKernels simd;
+
+void initSimd();
+
+#endif
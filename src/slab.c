@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include "slab.h"
+
+#ifndef NO_SLAB_ALLOCATOR
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / SLAB_GRANULE)
+// Páginas alinhadas ao próprio tamanho: o cabeçalho de qualquer bloco é
+// achado zerando os bits baixos do ponteiro.
+#define SLAB_PAGE_SIZE (64 * 1024)
+// Páginas vazias guardadas para reuso (por qualquer classe) antes de voltar
+// ao sistema; cobre o berçário inteiro, que esvazia a cada coleta menor.
+#define SLAB_SPARE_PAGES 32
+#define SLAB_HEADER_SIZE ((sizeof(SlabPage) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+typedef struct FreeSlot {
+    struct FreeSlot* next;
+} FreeSlot;
+
+typedef struct SlabPage {
+    struct SlabPage* prev;
+    struct SlabPage* next;
+    FreeSlot* freeList;   // blocos devolvidos
+    char* bump;           // primeiro bloco nunca usado
+    int live;
+    int sizeClass;
+    bool isFull;
+} SlabPage;
+
+typedef struct {
+    SlabPage* partial;    // páginas com algum bloco livre
+    SlabPage* full;
+} SlabClass;
+
+static SlabClass classes[SLAB_CLASS_COUNT];
+static SlabPage* sparePages;
+static int spareCount;
+
+static size_t slotSize(int sizeClass) {
+    return (size_t)(sizeClass + 1) * SLAB_GRANULE;
+}
+
+static void* allocatePage() {
+#ifdef _WIN32
+    return _aligned_malloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+#else
+    return aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+#endif
+}
+
+static void releasePage(SlabPage* page) {
+#ifdef _WIN32
+    _aligned_free(page);
+#else
+    free(page);
+#endif
+}
+
+static void unlinkPage(SlabPage** list, SlabPage* page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    } else {
+        *list = page->next;
+    }
+    if (page->next != NULL) page->next->prev = page->prev;
+    page->prev = NULL;
+    page->next = NULL;
+}
+
+static void linkPage(SlabPage** list, SlabPage* page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) (*list)->prev = page;
+    *list = page;
+}
+
+static SlabPage* newPage(int sizeClass) {
+    SlabPage* page = sparePages;
+    if (page != NULL) {
+        sparePages = page->next;
+        spareCount--;
+    } else {
+        page = (SlabPage*)allocatePage();
+        if (page == NULL) exit(1);
+    }
+    page->freeList = NULL;
+    page->bump = (char*)page + SLAB_HEADER_SIZE;
+    page->live = 0;
+    page->sizeClass = sizeClass;
+    page->isFull = false;
+    linkPage(&classes[sizeClass].partial, page);
+    return page;
+}
+
+void* slabAllocate(size_t size) {
+    int sizeClass = SLAB_CLASS(size);
+    SlabClass* slabClass = &classes[sizeClass];
+    SlabPage* page = slabClass->partial;
+    if (page == NULL) page = newPage(sizeClass);
+
+    size_t slot = slotSize(sizeClass);
+    void* result;
+    if (page->freeList != NULL) {
+        result = page->freeList;
+        page->freeList = page->freeList->next;
+    } else {
+        result = page->bump;
+        page->bump += slot;
+    }
+    page->live++;
+
+    if (page->freeList == NULL && page->bump + slot > (char*)page + SLAB_PAGE_SIZE) {
+        unlinkPage(&slabClass->partial, page);
+        linkPage(&slabClass->full, page);
+        page->isFull = true;
+    }
+    return result;
+}
+
+void slabFree(void* pointer, size_t size) {
+    (void)size;
+    SlabPage* page = (SlabPage*)((uintptr_t)pointer & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    SlabClass* slabClass = &classes[page->sizeClass];
+
+    FreeSlot* slot = (FreeSlot*)pointer;
+    slot->next = page->freeList;
+    page->freeList = slot;
+    page->live--;
+
+    if (page->isFull) {
+        unlinkPage(&slabClass->full, page);
+        linkPage(&slabClass->partial, page);
+        page->isFull = false;
+    }
+
+    // A última página com espaço livre da classe fica onde está, para um
+    // ciclo aloca/libera não ficar trocando de página.
+    if (page->live == 0 && (page->prev != NULL || page->next != NULL)) {
+        unlinkPage(&slabClass->partial, page);
+        if (spareCount < SLAB_SPARE_PAGES) {
+            page->next = sparePages;
+            sparePages = page;
+            spareCount++;
+        } else {
+            releasePage(page);
+        }
+    }
+}
+
+static void releaseList(SlabPage* page) {
+    while (page != NULL) {
+        SlabPage* next = page->next;
+        releasePage(page);
+        page = next;
+    }
+}
+
+void freeSlabs() {
+    for (int i = 0; i < SLAB_CLASS_COUNT; i++) {
+        releaseList(classes[i].partial);
+        releaseList(classes[i].full);
+        classes[i].partial = NULL;
+        classes[i].full = NULL;
+    }
+    releaseList(sparePages);
+    sparePages = NULL;
+    spareCount = 0;
+}
+
+#else
+
+void freeSlabs() {}
+
+#endif
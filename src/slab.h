@@ -0,0 +1,26 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+
+// Blocos de até SLAB_MAX_SIZE bytes saem de páginas separadas por classe de
+// tamanho; o resto vai direto para o malloc. Compilar com -DNO_SLAB_ALLOCATOR
+// manda tudo para o malloc, o que o ASan precisa para enxergar cada bloco.
+#if !defined(NO_SLAB_ALLOCATOR) && defined(__SANITIZE_ADDRESS__)
+#define NO_SLAB_ALLOCATOR
+#endif
+#if !defined(NO_SLAB_ALLOCATOR) && defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NO_SLAB_ALLOCATOR
+#endif
+#endif
+
+#define SLAB_MAX_SIZE 256
+#define SLAB_GRANULE 16
+#define SLAB_CLASS(size) ((int)(((size) - 1) / SLAB_GRANULE))
+
+void* slabAllocate(size_t size);
+void slabFree(void* pointer, size_t size);
+void freeSlabs();
+
+#endif
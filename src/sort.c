@@ -0,0 +1,253 @@
+#include "sort.h"
+#include "object.h"
+#include "vm.h"
+
+// pdqsort (Orson Peters): quicksort com mediana de 3 (ou de 9), que detecta
+// partições já ordenadas e termina com insertion sort parcial, embaralha o
+// pivô quando a partição sai desbalanceada e cai para heapsort depois de
+// log2(n) partições ruins. Chaves iguais ao pivô anterior vão para a
+// esquerda de uma vez (partitionLeft), o que deixa muitas repetições em O(n).
+//
+// O comparador do usuário pode ser inconsistente, então todo laço de
+// partição tem limite explícito em vez de depender de sentinelas.
+#define INSERTION_SORT_THRESHOLD 24
+#define NINTHER_THRESHOLD 128
+#define PARTIAL_INSERTION_LIMIT 8
+
+typedef struct {
+    SortKind kind;
+    Value compare;
+    bool failed;
+} Sorter;
+
+static inline bool compareStrings(Value a, Value b) {
+    int aLength, bLength;
+    const char* aChars = stringContents(a, &aLength);
+    const char* bChars = stringContents(b, &bLength);
+    int order = memcmp(aChars, bChars, (size_t)(aLength < bLength ? aLength : bLength));
+    return order != 0 ? order < 0 : aLength < bLength;
+}
+
+// Depois de um erro o comparador vira "tudo igual", que ainda é uma ordem
+// válida: o algoritmo termina sem chamar a VM de novo.
+static inline bool less(Sorter* sorter, Value a, Value b) {
+    switch (sorter->kind) {
+        case SORT_NUMBERS: {
+            double x = AS_NUMBER(a);
+            double y = AS_NUMBER(b);
+            return x < y || (y != y && x == x);
+        }
+        case SORT_STRINGS:
+            return compareStrings(a, b);
+        case SORT_CALLBACK: {
+            if (sorter->failed) return false;
+            Value pair[2] = { a, b };
+            Value order;
+            if (!vmCall(sorter->compare, 2, pair, &order)) {
+                sorter->failed = true;
+                return false;
+            }
+            if (IS_NUMBER(order)) return AS_NUMBER(order) < 0;
+            return !IS_NIL(order) && !(IS_BOOL(order) && !AS_BOOL(order));
+        }
+    }
+    return false;
+}
+
+static inline void swap(Value* values, int a, int b) {
+    Value temp = values[a];
+    values[a] = values[b];
+    values[b] = temp;
+}
+
+static void insertionSort(Sorter* sorter, Value* values, int begin, int end) {
+    for (int i = begin + 1; i < end; i++) {
+        if (!less(sorter, values[i], values[i - 1])) continue;
+        Value item = values[i];
+        int j = i;
+        do {
+            values[j] = values[j - 1];
+            j--;
+        } while (j > begin && less(sorter, item, values[j - 1]));
+        values[j] = item;
+    }
+}
+
+// Desiste (devolvendo false) depois de PARTIAL_INSERTION_LIMIT movimentos.
+static bool partialInsertionSort(Sorter* sorter, Value* values, int begin, int end) {
+    int moves = 0;
+    for (int i = begin + 1; i < end; i++) {
+        if (!less(sorter, values[i], values[i - 1])) continue;
+        Value item = values[i];
+        int j = i;
+        do {
+            values[j] = values[j - 1];
+            j--;
+        } while (j > begin && less(sorter, item, values[j - 1]));
+        values[j] = item;
+        moves += i - j;
+        if (moves > PARTIAL_INSERTION_LIMIT) return false;
+    }
+    return true;
+}
+
+static void sort2(Sorter* sorter, Value* values, int a, int b) {
+    if (less(sorter, values[b], values[a])) swap(values, a, b);
+}
+
+static void sort3(Sorter* sorter, Value* values, int a, int b, int c) {
+    sort2(sorter, values, a, b);
+    sort2(sorter, values, b, c);
+    sort2(sorter, values, a, b);
+}
+
+static void siftDown(Sorter* sorter, Value* values, int begin, int root, int count) {
+    for (;;) {
+        int child = 2 * root + 1;
+        if (child >= count) return;
+        if (child + 1 < count &&
+            less(sorter, values[begin + child], values[begin + child + 1])) {
+            child++;
+        }
+        if (!less(sorter, values[begin + root], values[begin + child])) return;
+        swap(values, begin + root, begin + child);
+        root = child;
+    }
+}
+
+static void heapSort(Sorter* sorter, Value* values, int begin, int end) {
+    int count = end - begin;
+    for (int i = count / 2 - 1; i >= 0; i--) siftDown(sorter, values, begin, i, count);
+    for (int i = count - 1; i > 0; i--) {
+        swap(values, begin, begin + i);
+        siftDown(sorter, values, begin, 0, i);
+    }
+}
+
+// Pivô em values[begin]. Menores à esquerda, maiores ou iguais à direita;
+// devolve a posição final do pivô e se nada precisou ser trocado.
+static int partitionRight(Sorter* sorter, Value* values, int begin, int end,
+                          bool* alreadyPartitioned) {
+    Value pivot = values[begin];
+    int first = begin;
+    int last = end;
+
+    do first++; while (first < end && less(sorter, values[first], pivot));
+    if (first - 1 == begin) {
+        while (first < last && !less(sorter, values[--last], pivot)) {}
+    } else {
+        do last--; while (last > begin && !less(sorter, values[last], pivot));
+    }
+
+    *alreadyPartitioned = first >= last;
+    while (first < last) {
+        swap(values, first, last);
+        do first++; while (first < end && less(sorter, values[first], pivot));
+        do last--; while (last > begin && !less(sorter, values[last], pivot));
+    }
+
+    int pivotPosition = first - 1;
+    values[begin] = values[pivotPosition];
+    values[pivotPosition] = pivot;
+    return pivotPosition;
+}
+
+// Usada quando o pivô é igual ao elemento logo antes do intervalo: tudo
+// que for igual a ele fica à esquerda e não precisa mais ser ordenado.
+static int partitionLeft(Sorter* sorter, Value* values, int begin, int end) {
+    Value pivot = values[begin];
+    int first = begin;
+    int last = end;
+
+    do last--; while (last > begin && less(sorter, pivot, values[last]));
+    if (last + 1 == end) {
+        while (first < last && !less(sorter, pivot, values[++first])) {}
+    } else {
+        do first++; while (first < end && !less(sorter, pivot, values[first]));
+    }
+
+    while (first < last) {
+        swap(values, first, last);
+        do last--; while (last > begin && less(sorter, pivot, values[last]));
+        do first++; while (first < end && !less(sorter, pivot, values[first]));
+    }
+
+    values[begin] = values[last];
+    values[last] = pivot;
+    return last;
+}
+
+static void pdqsort(Sorter* sorter, Value* values, int begin, int end,
+                    int badAllowed, bool leftmost) {
+    for (;;) {
+        int size = end - begin;
+        if (size < INSERTION_SORT_THRESHOLD) {
+            insertionSort(sorter, values, begin, end);
+            return;
+        }
+
+        int half = size / 2;
+        if (size > NINTHER_THRESHOLD) {
+            sort3(sorter, values, begin, begin + half, end - 1);
+            sort3(sorter, values, begin + 1, begin + half - 1, end - 2);
+            sort3(sorter, values, begin + 2, begin + half + 1, end - 3);
+            sort3(sorter, values, begin + half - 1, begin + half, begin + half + 1);
+            swap(values, begin, begin + half);
+        } else {
+            sort3(sorter, values, begin + half, begin, end - 1);
+        }
+
+        if (!leftmost && !less(sorter, values[begin - 1], values[begin])) {
+            begin = partitionLeft(sorter, values, begin, end) + 1;
+            continue;
+        }
+
+        bool alreadyPartitioned;
+        int pivot = partitionRight(sorter, values, begin, end, &alreadyPartitioned);
+        int leftSize = pivot - begin;
+        int rightSize = end - (pivot + 1);
+
+        if (leftSize < size / 8 || rightSize < size / 8) {
+            if (--badAllowed == 0) {
+                heapSort(sorter, values, begin, end);
+                return;
+            }
+            if (leftSize >= INSERTION_SORT_THRESHOLD) {
+                swap(values, begin, begin + leftSize / 4);
+                swap(values, pivot - 1, pivot - leftSize / 4);
+                if (leftSize > NINTHER_THRESHOLD) {
+                    swap(values, begin + 1, begin + (leftSize / 4 + 1));
+                    swap(values, begin + 2, begin + (leftSize / 4 + 2));
+                    swap(values, pivot - 2, pivot - (leftSize / 4 + 1));
+                    swap(values, pivot - 3, pivot - (leftSize / 4 + 2));
+                }
+            }
+            if (rightSize >= INSERTION_SORT_THRESHOLD) {
+                swap(values, pivot + 1, pivot + (1 + rightSize / 4));
+                swap(values, end - 1, end - rightSize / 4);
+                if (rightSize > NINTHER_THRESHOLD) {
+                    swap(values, pivot + 2, pivot + (2 + rightSize / 4));
+                    swap(values, pivot + 3, pivot + (3 + rightSize / 4));
+                    swap(values, end - 2, end - (1 + rightSize / 4));
+                    swap(values, end - 3, end - (2 + rightSize / 4));
+                }
+            }
+        } else if (alreadyPartitioned &&
+                   partialInsertionSort(sorter, values, begin, pivot) &&
+                   partialInsertionSort(sorter, values, pivot + 1, end)) {
+            return;
+        }
+
+        pdqsort(sorter, values, begin, pivot, badAllowed, leftmost);
+        begin = pivot + 1;
+        leftmost = false;
+    }
+}
+
+bool sortValues(Value* values, int count, SortKind kind, Value compare) {
+    Sorter sorter = { kind, compare, false };
+    int badAllowed = 0;
+    for (int n = count; n > 1; n >>= 1) badAllowed++;
+    pdqsort(&sorter, values, 0, count, badAllowed, true);
+    return !sorter.failed;
+}
@@ -0,0 +1,20 @@
+#ifndef clox_sort_h
+#define clox_sort_h
+
+#include "common.h"
+#include "value.h"
+
+// Ordenação in-place por pattern-defeating quicksort. SORT_NUMBERS e
+// SORT_STRINGS comparam direto em C (NaN vai para o fim); SORT_CALLBACK
+// chama compare(a, b) via vmCall, que diz se a vem antes de b com um número
+// negativo ou true. Só SORT_CALLBACK falha (erro no comparador); nesse caso
+// os valores ficam numa permutação qualquer da entrada.
+typedef enum {
+    SORT_NUMBERS,
+    SORT_STRINGS,
+    SORT_CALLBACK
+} SortKind;
+
+bool sortValues(Value* values, int count, SortKind kind, Value compare);
+
+#endif
@@ -5,94 +5,201 @@
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Com bytes de controle a sondagem é barata mesmo com a tabela cheia.
+#define TABLE_MAX_LOAD_NUM 7
+#define TABLE_MAX_LOAD_DEN 8
+#define TABLE_MIN_CAPACITY TABLE_GROUP_WIDTH
+
+#define CONTROL_EMPTY   ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+// Os 7 bits altos do hash vão para o byte de controle; os baixos escolhem o grupo.
+#define H2(hash) ((int8_t)((hash) >> 25))
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
 void freeTable(Table* table) {
     FREE_ARRAY(Entry, table->entries, table->capacity);
+    if (table->capacity > 0) {
+        FREE_ARRAY(int8_t, table->control, table->capacity + TABLE_GROUP_WIDTH);
+    }
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+// Bit i ligado quando o byte i do grupo começando em control é igual a value.
+static inline uint32_t matchGroup(const int8_t* control, int8_t value) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)control);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (control[i] == value) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Slots vazios ou apagados (bit de sinal ligado).
+static inline uint32_t matchFree(const int8_t* control) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)control));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        if (control[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline int lowestBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+static inline void setControl(Table* table, int index, int8_t value) {
+    table->control[index] = value;
+    // Espelho dos primeiros bytes, para um grupo perto do fim poder ser lido
+    // de uma vez sem dar a volta.
+    if (index < TABLE_GROUP_WIDTH) table->control[table->capacity + index] = value;
+}
+
+// Sondagem quadrática por grupos: com capacidade potência de dois, todos os
+// grupos são visitados antes de repetir.
+#define PROBE_START(hash, mask) ((int)((hash) & (mask)))
+#define PROBE_NEXT(position, step, mask) (((position) + ((step) += TABLE_GROUP_WIDTH)) & (mask))
+
+static Entry* findEntry(Table* table, ObjString* key) {
+    int mask = table->capacity - 1;
+    int8_t h2 = H2(key->hash);
+    int position = PROBE_START(key->hash, mask);
+    int step = 0;
     for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+        const int8_t* group = table->control + position;
+        uint32_t match = matchGroup(group, h2);
+        while (match != 0) {
+            int index = (position + lowestBit(match)) & mask;
+            if (table->entries[index].key == key) return &table->entries[index];
+            match &= match - 1;
         }
+        if (matchGroup(group, CONTROL_EMPTY) != 0) return NULL;
+        position = PROBE_NEXT(position, step, mask);
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// Primeiro slot livre (vazio ou apagado) na sequência de sondagem de hash.
+static int findFreeSlot(Table* table, uint32_t hash) {
+    int mask = table->capacity - 1;
+    int position = PROBE_START(hash, mask);
+    int step = 0;
+    for (;;) {
+        uint32_t free = matchFree(table->control + position);
+        if (free != 0) return (position + lowestBit(free)) & mask;
+        position = PROBE_NEXT(position, step, mask);
     }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
     *value = entry->value;
     return true;
 }
 
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* oldEntries = table->entries;
+    int8_t* oldControl = table->control;
+    int oldCapacity = table->capacity;
 
+    Entry* entries = ALLOCATE(Entry, capacity);
+    int8_t* control = ALLOCATE(int8_t, capacity + TABLE_GROUP_WIDTH);
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
-    
+    memset(control, (uint8_t)CONTROL_EMPTY, (size_t)(capacity + TABLE_GROUP_WIDTH));
+
+    table->entries = entries;
+    table->control = control;
+    table->capacity = capacity;
     table->count = 0;
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
+    table->tombstones = 0;
+    for (int i = 0; i < oldCapacity; i++) {
+        Entry* entry = &oldEntries[i];
         if (entry->key == NULL) continue;
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int index = findFreeSlot(table, entry->key->hash);
+        setControl(table, index, H2(entry->key->hash));
+        table->entries[index] = *entry;
         table->count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(Entry, oldEntries, oldCapacity);
+    if (oldCapacity > 0) FREE_ARRAY(int8_t, oldControl, oldCapacity + TABLE_GROUP_WIDTH);
 }
 
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    if (table->count > 0) {
+        Entry* entry = findEntry(table, key);
+        if (entry != NULL) {
+            entry->value = value;
+            return false;
+        }
+    }
+
+    if ((table->count + table->tombstones + 1) * TABLE_MAX_LOAD_DEN >
+        table->capacity * TABLE_MAX_LOAD_NUM) {
+        // Se a carga vem mais das lápides que das chaves vivas, reconstruir no
+        // mesmo tamanho basta.
+        int capacity = table->capacity;
+        if (capacity == 0) {
+            capacity = TABLE_MIN_CAPACITY;
+        } else if ((table->count + 1) * 2 * TABLE_MAX_LOAD_DEN > capacity * TABLE_MAX_LOAD_NUM) {
+            capacity *= 2;
+        }
         adjustCapacity(table, capacity);
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    int index = findFreeSlot(table, key->hash);
+    if (table->control[index] == CONTROL_DELETED) table->tombstones--;
+    setControl(table, index, H2(key->hash));
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table, key);
+    if (entry == NULL) return false;
 
+    setControl(table, (int)(entry - table->entries), CONTROL_DELETED);
     entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    entry->value = NIL_VAL;
     table->count--;
-
+    table->tombstones++;
     return true;
 }
 
@@ -108,25 +215,30 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
+    int mask = table->capacity - 1;
+    int8_t h2 = H2(hash);
+    int position = PROBE_START(hash, mask);
+    int step = 0;
     for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length &&
-                   entry->key->hash == hash &&
-                   memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+        const int8_t* group = table->control + position;
+        uint32_t match = matchGroup(group, h2);
+        while (match != 0) {
+            ObjString* key = table->entries[(position + lowestBit(match)) & mask].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
+            match &= match - 1;
         }
-
-        index = (index + 1) & (table->capacity - 1);
+        if (matchGroup(group, CONTROL_EMPTY) != 0) return NULL;
+        position = PROBE_NEXT(position, step, mask);
     }
 }
 
 void tableRemoveWhite(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && isUnreachable((Obj*)entry->key)) {
             tableDelete(table, entry->key);
         }
     }
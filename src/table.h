@@ -9,10 +9,18 @@ typedef struct {
     Value value;
 } Entry;
 
+// Swiss table: um byte de controle por slot (vazio, apagado ou os 7 bits
+// altos do hash) é varrido em grupos de TABLE_GROUP_WIDTH com SSE2, e só os
+// slots cujo byte bate são lidos. Slots livres têm key == NULL, então dá
+// para percorrer entries[0..capacity) olhando só a chave.
+#define TABLE_GROUP_WIDTH 16
+
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
     Entry* entries;
+    int8_t* control;    // capacity + TABLE_GROUP_WIDTH bytes; o fim espelha o começo
 } Table;
 
 void initTable(Table* table);
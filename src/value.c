@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include "object.h"
@@ -30,6 +31,20 @@ void freeValueArray(ValueArray* array) {
     initValueArray(array);
 }
 
+// %g escreve NaN e infinito de um jeito em cada runtime de C (a glibc dá
+// "-nan", o do Windows "-nan(ind)"), então esses três saem sempre iguais.
+int formatNumber(char* buffer, size_t size, double number) {
+    if (isnan(number)) return snprintf(buffer, size, "nan");
+    if (isinf(number)) return snprintf(buffer, size, number > 0 ? "inf" : "-inf");
+    return snprintf(buffer, size, "%g", number);
+}
+
+static void printNumber(FILE* file, double number) {
+    char buffer[32];
+    formatNumber(buffer, sizeof(buffer), number);
+    fputs(buffer, file);
+}
+
 void printValue(FILE* file, Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
@@ -37,7 +52,7 @@ void printValue(FILE* file, Value value) {
     } else if (IS_NIL(value)) {
         fprintf(file, "nil");
     } else if (IS_NUMBER(value)) {
-        fprintf(file, "%g", AS_NUMBER(value));
+        printNumber(file, AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
 #ifdef _WIN32
         if (IS_STRING(value)) {
@@ -65,7 +80,8 @@ void printValue(FILE* file, Value value) {
     switch (value.type) {
         case VAL_BOOL: fprintf(file, AS_BOOL(value) ? "true" : "false"); break;
         case VAL_NIL: fprintf(file, "nil"); break;
-        case VAL_NUMBER: fprintf(file, "%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER: printNumber(file, AS_NUMBER(value)); break;
+        case VAL_UNDEFINED: break;
         case VAL_OBJ:
 #ifdef _WIN32
             if (IS_STRING(value)) {
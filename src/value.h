@@ -16,11 +16,13 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1
 #define TAG_FALSE 2
 #define TAG_TRUE  3
+#define TAG_UNDEFINED 4
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)   (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)    ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value)    ((((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT)))
 #define IS_LIST(value)    (IS_OBJ(value) && AS_OBJ(value)->type == OBJ_LIST)
@@ -34,6 +36,7 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj)    ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj)))
 
@@ -56,6 +59,7 @@ typedef enum {
     VAL_NIL,
     VAL_NUMBER,
     VAL_OBJ,
+    VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -69,6 +73,7 @@ typedef struct {
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 #define IS_LIST(value)    (IS_OBJ(value) && AS_OBJ(value)->type == OBJ_LIST)
@@ -80,6 +85,7 @@ typedef struct {
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}}) 
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(value)    ((Value){VAL_OBJ, {.obj = (Obj*)value}})
 
@@ -95,6 +101,7 @@ bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+int formatNumber(char* buffer, size_t size, double number);
 void printValue(FILE* file, Value value);
 
 #endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
@@ -14,13 +15,18 @@
 #include "context.h"
 #include "errors.h"
 #include "semantic.h"
+#include "simd.h"
+#include "sort.h"
+#include "slab.h"
 #include "type_checking.h"
 
 VM vm;
 
 static void resetStack();
 static void runtimeError(const char* format, ...);
+static bool isFalsey(Value value);
 static void defineNative(const char* name, NativeFn function, int argCount);
+static bool callWithReceiver(Value receiver, Value callee, int argCount, Value* args, Value* out);
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[(uint8_t)READ_BYTE()])
@@ -28,6 +34,7 @@ static void defineNative(const char* name, NativeFn function, int argCount);
 #define READ_SHORT() \
         (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
 #define READ_STRING() AS_STRING(READ_CONSTANT_16())
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
 
 static void runtimeError(const char* format, ...);
 
@@ -126,8 +133,18 @@ static bool setNative(int argCount, Value* args, Value* result) {
 }
 
 static bool lengthNative(int argCount, Value* args, Value* result) {
+    if (IS_F64ARRAY(args[0])) {
+        *result = NUMBER_VAL(AS_F64ARRAY(args[0])->count);
+        return true;
+    }
+    if (IS_STRING_LIKE(args[0])) {
+        int length;
+        stringContents(args[0], &length);
+        *result = NUMBER_VAL(length);
+        return true;
+    }
     if (!IS_LIST(args[0])) {
-        runtimeError("Argumento de length deve ser uma lista.");
+        runtimeError("Argumento de length deve ser uma lista, string ou f64array.");
         return false;
     }
     *result = NUMBER_VAL(listLength(AS_LIST(args[0])));
@@ -139,31 +156,34 @@ static bool dictNative(int argCount, Value* args, Value* result) {
     return true;
 }
 
+// Chaves podem ser qualquer valor; instâncias com __hash__/__eq__ rodam
+// código Lox no meio da operação, que pode realocar a pilha (e args).
 static bool dictSetNative(int argCount, Value* args, Value* result) {
-    if (!IS_DICT(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("Argumentos de dictSet devem ser (dicionário, chave_string, valor).");
+    if (!IS_DICT(args[0])) {
+        runtimeError("Argumentos de dictSet devem ser (dicionário, chave, valor).");
         return false;
     }
-    dictSet(AS_DICT(args[0]), args[1], args[2]);
+    if (!dictSet(AS_DICT(args[0]), args[1], args[2])) return false;
     *result = NIL_VAL;
     return true;
 }
 
 static bool dictGetNative(int argCount, Value* args, Value* result) {
-    if (!IS_DICT(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("Argumentos de dictGet devem ser (dicionário, chave_string).");
+    if (!IS_DICT(args[0])) {
+        runtimeError("Argumentos de dictGet devem ser (dicionário, chave).");
         return false;
     }
-    *result = dictGet(AS_DICT(args[0]), args[1]);
-    return true;
+    return dictGet(AS_DICT(args[0]), args[1], result);
 }
 
 static bool dictDeleteNative(int argCount, Value* args, Value* result) {
-    if (!IS_DICT(args[0]) || !IS_STRING(args[1])) {
-        runtimeError("Argumentos de dictDelete devem ser (dicionário, chave_string).");
+    if (!IS_DICT(args[0])) {
+        runtimeError("Argumentos de dictDelete devem ser (dicionário, chave).");
         return false;
     }
-    *result = BOOL_VAL(dictDelete(AS_DICT(args[0]), args[1]));
+    bool deleted;
+    if (!dictDelete(AS_DICT(args[0]), args[1], &deleted)) return false;
+    *result = BOOL_VAL(deleted);
     return true;
 }
 
@@ -177,30 +197,30 @@ static bool dictLengthNative(int argCount, Value* args, Value* result) {
 }
 
 static bool enumNative(int argCount, Value* args, Value* result) {
-    if (!IS_STRING(args[0])) {
+    if (!IS_STRING_LIKE(args[0])) {
         runtimeError("Argumento de enum deve ser uma string (nome do enum).");
         return false;
     }
-    *result = OBJ_VAL(newEnum(AS_STRING(args[0])));
+    *result = OBJ_VAL(newEnum(flattenString(args[0])));
     return true;
 }
 
 static bool enumAddValueNative(int argCount, Value* args, Value* result) {
-    if (!IS_ENUM(args[0]) || !IS_STRING(args[1])) {
+    if (!IS_ENUM(args[0]) || !IS_STRING_LIKE(args[1])) {
         runtimeError("Argumentos de enumAddValue devem ser (enum, nome_string, valor).");
         return false;
     }
-    enumAddValue(AS_ENUM(args[0]), AS_STRING(args[1]), args[2]);
+    enumAddValue(AS_ENUM(args[0]), flattenString(args[1]), args[2]);
     *result = NIL_VAL;
     return true;
 }
 
 static bool enumGetValueNative(int argCount, Value* args, Value* result) {
-    if (!IS_ENUM(args[0]) || !IS_STRING(args[1])) {
+    if (!IS_ENUM(args[0]) || !IS_STRING_LIKE(args[1])) {
         runtimeError("Argumentos de enumGetValue devem ser (enum, nome_string).");
         return false;
     }
-    *result = enumGetValue(AS_ENUM(args[0]), AS_STRING(args[1]));
+    *result = enumGetValue(AS_ENUM(args[0]), flattenString(args[1]));
     return true;
 }
 
@@ -213,9 +233,332 @@ static bool enumLengthNative(int argCount, Value* args, Value* result) {
     return true;
 }
 
+// Arrays f64: os kernels vetoriais de simd.h fazem o laço em C.
+static ObjF64Array* f64Argument(Value value, const char* native) {
+    if (!IS_F64ARRAY(value)) {
+        runtimeError("Argumento de %s deve ser um f64array.", native);
+        return NULL;
+    }
+    return AS_F64ARRAY(value);
+}
+
+static bool sameLength(ObjF64Array* a, ObjF64Array* b, const char* native) {
+    if (a->count != b->count) {
+        runtimeError("Arrays de %s devem ter o mesmo tamanho (%d e %d).", native, a->count, b->count);
+        return false;
+    }
+    return true;
+}
+
+static bool f64arrayNative(int argCount, Value* args, Value* result) {
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 ||
+        AS_NUMBER(args[0]) > INT32_MAX / (int)sizeof(double) ||
+        AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0])) {
+        runtimeError("Argumento de f64array deve ser um tamanho inteiro não negativo.");
+        return false;
+    }
+    *result = OBJ_VAL(newF64Array((int)AS_NUMBER(args[0])));
+    return true;
+}
+
+static bool f64FromListNative(int argCount, Value* args, Value* result) {
+    if (!IS_LIST(args[0])) {
+        runtimeError("Argumento de f64FromList deve ser uma lista.");
+        return false;
+    }
+    ObjList* list = AS_LIST(args[0]);
+    Value* values = listValues(list);
+    for (int i = 0; i < list->count; i++) {
+        if (!IS_NUMBER(values[i])) {
+            runtimeError("Elemento %d da lista não é um número.", i);
+            return false;
+        }
+    }
+    ObjF64Array* array = newF64Array(list->count);
+    values = listValues(list);
+    for (int i = 0; i < list->count; i++) array->values[i] = AS_NUMBER(values[i]);
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+static bool f64ToListNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* array = f64Argument(args[0], "f64ToList");
+    if (array == NULL) return false;
+    ObjList* list = newList();
+    push(OBJ_VAL(list));
+    for (int i = 0; i < array->count; i++) listAppend(list, NUMBER_VAL(array->values[i]));
+    *result = pop();
+    return true;
+}
+
+static bool f64SumNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* array = f64Argument(args[0], "f64Sum");
+    if (array == NULL) return false;
+    *result = NUMBER_VAL(simd.sum(array->values, array->count));
+    return true;
+}
+
+static bool f64MinNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* array = f64Argument(args[0], "f64Min");
+    if (array == NULL) return false;
+    *result = array->count == 0 ? NIL_VAL : NUMBER_VAL(simd.min(array->values, array->count));
+    return true;
+}
+
+static bool f64MaxNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* array = f64Argument(args[0], "f64Max");
+    if (array == NULL) return false;
+    *result = array->count == 0 ? NIL_VAL : NUMBER_VAL(simd.max(array->values, array->count));
+    return true;
+}
+
+static bool f64DotNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* a = f64Argument(args[0], "f64Dot");
+    ObjF64Array* b = a == NULL ? NULL : f64Argument(args[1], "f64Dot");
+    if (b == NULL || !sameLength(a, b, "f64Dot")) return false;
+    *result = NUMBER_VAL(simd.dot(a->values, b->values, a->count));
+    return true;
+}
+
+// f64Axpy(alpha, x, y): y += alpha * x, no lugar; devolve y.
+static bool f64AxpyNative(int argCount, Value* args, Value* result) {
+    if (!IS_NUMBER(args[0])) {
+        runtimeError("Primeiro argumento de f64Axpy deve ser um número.");
+        return false;
+    }
+    ObjF64Array* x = f64Argument(args[1], "f64Axpy");
+    ObjF64Array* y = x == NULL ? NULL : f64Argument(args[2], "f64Axpy");
+    if (y == NULL || !sameLength(x, y, "f64Axpy")) return false;
+    simd.axpy(AS_NUMBER(args[0]), x->values, y->values, x->count);
+    *result = args[2];
+    return true;
+}
+
+// f64Scale(array, alpha): multiplica no lugar; devolve o próprio array.
+static bool f64ScaleNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* array = f64Argument(args[0], "f64Scale");
+    if (array == NULL) return false;
+    if (!IS_NUMBER(args[1])) {
+        runtimeError("Segundo argumento de f64Scale deve ser um número.");
+        return false;
+    }
+    simd.scale(AS_NUMBER(args[1]), array->values, array->count);
+    *result = args[0];
+    return true;
+}
+
+static bool f64AddNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* a = f64Argument(args[0], "f64Add");
+    ObjF64Array* b = a == NULL ? NULL : f64Argument(args[1], "f64Add");
+    if (b == NULL || !sameLength(a, b, "f64Add")) return false;
+    ObjF64Array* out = newF64Array(a->count);
+    simd.add(a->values, b->values, out->values, a->count);
+    *result = OBJ_VAL(out);
+    return true;
+}
+
+static bool f64MulNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* a = f64Argument(args[0], "f64Mul");
+    ObjF64Array* b = a == NULL ? NULL : f64Argument(args[1], "f64Mul");
+    if (b == NULL || !sameLength(a, b, "f64Mul")) return false;
+    ObjF64Array* out = newF64Array(a->count);
+    simd.mul(a->values, b->values, out->values, a->count);
+    *result = OBJ_VAL(out);
+    return true;
+}
+
+static bool f64PrefixSumNative(int argCount, Value* args, Value* result) {
+    ObjF64Array* array = f64Argument(args[0], "f64PrefixSum");
+    if (array == NULL) return false;
+    ObjF64Array* out = newF64Array(array->count);
+    simd.prefixSum(array->values, out->values, array->count);
+    *result = OBJ_VAL(out);
+    return true;
+}
+
+// Nativas de ordem superior: o laço roda em C e o callback via vmCall.
+// A lista e a função continuam na pilha (args) durante as chamadas, mas
+// args pode mudar de lugar, então os valores são copiados antes.
+static ObjList* listArgument(Value value, const char* name) {
+    if (!IS_LIST(value)) {
+        runtimeError("Primeiro argumento de %s deve ser uma lista.", name);
+        return NULL;
+    }
+    return AS_LIST(value);
+}
+
+static bool mapNative(int argCount, Value* args, Value* result) {
+    ObjList* list = listArgument(args[0], "map");
+    if (list == NULL) return false;
+    Value function = args[1];
+    ObjList* mapped = newList();
+    push(OBJ_VAL(mapped));
+    for (int i = 0; i < list->count; i++) {
+        Value item = listValues(list)[i];
+        if (!vmCall(function, 1, &item, &item)) return false;
+        push(item);
+        listAppend(mapped, item);
+        pop();
+    }
+    *result = pop();
+    return true;
+}
+
+static bool filterNative(int argCount, Value* args, Value* result) {
+    ObjList* list = listArgument(args[0], "filter");
+    if (list == NULL) return false;
+    Value function = args[1];
+    ObjList* kept = newList();
+    push(OBJ_VAL(kept));
+    for (int i = 0; i < list->count; i++) {
+        Value item = listValues(list)[i];
+        Value keep;
+        if (!vmCall(function, 1, &item, &keep)) return false;
+        // item pode ter saído da lista durante o callback.
+        push(item);
+        if (!isFalsey(keep)) listAppend(kept, item);
+        pop();
+    }
+    *result = pop();
+    return true;
+}
+
+static bool reduceNative(int argCount, Value* args, Value* result) {
+    ObjList* list = listArgument(args[0], "reduce");
+    if (list == NULL) return false;
+    Value function = args[1];
+    // O acumulador ocupa o slot do valor inicial, onde o GC o enxerga.
+    int accumulator = (int)(args + 2 - vm.stack);
+    for (int i = 0; i < list->count; i++) {
+        Value pair[2] = { vm.stack[accumulator], listValues(list)[i] };
+        Value value;
+        if (!vmCall(function, 2, pair, &value)) return false;
+        vm.stack[accumulator] = value;
+    }
+    *result = vm.stack[accumulator];
+    return true;
+}
+
+static bool forEachNative(int argCount, Value* args, Value* result) {
+    ObjList* list = listArgument(args[0], "forEach");
+    if (list == NULL) return false;
+    Value function = args[1];
+    for (int i = 0; i < list->count; i++) {
+        Value item = listValues(list)[i];
+        Value ignored;
+        if (!vmCall(function, 1, &item, &ignored)) return false;
+    }
+    *result = NIL_VAL;
+    return true;
+}
+
+// sort(lista) ou sort(lista, cmp), in-place; devolve a própria lista.
+// Sem comparador a lista precisa ser só de números ou só de strings, que
+// são comparados em C. Com comparador, a ordenação roda numa cópia: o
+// callback pode mexer na lista, e a cópia guardada na pilha mantém todos os
+// valores vivos para o GC enquanto os temporários do pdqsort ficam em C.
+static bool sortNative(int argCount, Value* args, Value* result) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError("sort espera (lista) ou (lista, comparador).");
+        return false;
+    }
+    ObjList* list = listArgument(args[0], "sort");
+    if (list == NULL) return false;
+    Value sorted = args[0];
+    int count = list->count;
+
+    if (argCount == 1) {
+        bool numbers = true;
+        bool strings = true;
+        Value* values = listValues(list);
+        for (int i = 0; i < count; i++) {
+            numbers = numbers && IS_NUMBER(values[i]);
+            strings = strings && IS_STRING_LIKE(values[i]);
+        }
+        if (!numbers && !strings) {
+            runtimeError("sort sem comparador aceita só números ou só strings.");
+            return false;
+        }
+        listDetach(list);
+        sortValues(list->values, count, numbers ? SORT_NUMBERS : SORT_STRINGS, NIL_VAL);
+        *result = sorted;
+        return true;
+    }
+
+    Value compare = args[1];
+    ObjList* snapshot = newListFrom(listValues(list), count);
+    push(OBJ_VAL(snapshot));
+    Value* scratch = (Value*)malloc(sizeof(Value) * (count > 0 ? count : 1));
+    if (scratch == NULL) exit(1);
+    memcpy(scratch, snapshot->values, sizeof(Value) * count);
+
+    bool ok = sortValues(scratch, count, SORT_CALLBACK, compare);
+    if (ok && list->count != count) {
+        runtimeError("Lista modificada durante sort.");
+        ok = false;
+    }
+    if (ok) {
+        listDetach(list);
+        for (int i = 0; i < count; i++) {
+            list->values[i] = scratch[i];
+            writeBarrier((Obj*)list, scratch[i]);
+        }
+        pop();
+        *result = sorted;
+    }
+    free(scratch);
+    return ok;
+}
+
+// Confere os argumentos start e end de slice/substring: inteiros com
+// 0 <= start <= end <= count.
+static bool sliceBounds(Value* args, int count, const char* name, int* start, int* end) {
+    if (!IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
+        runtimeError("Início e fim de %s devem ser números.", name);
+        return false;
+    }
+    double from = AS_NUMBER(args[1]);
+    double to = AS_NUMBER(args[2]);
+    // O intervalo é conferido antes da conversão, que fora do alcance de int
+    // não é definida; a forma negada também recusa NaN.
+    if (!(from >= 0 && from <= to && to <= count) || (int)from != from || (int)to != to) {
+        runtimeError("Intervalo [%g, %g) inválido para %s de tamanho %d.", from, to, name, count);
+        return false;
+    }
+    *start = (int)from;
+    *end = (int)to;
+    return true;
+}
+
+// slice(lista, início, fim) devolve uma fatia que enxerga os valores da
+// lista original até ser modificada; aí ela ganha uma cópia própria.
+static bool sliceNative(int argCount, Value* args, Value* result) {
+    ObjList* list = listArgument(args[0], "slice");
+    int start, end;
+    if (list == NULL || !sliceBounds(args, list->count, "slice", &start, &end)) return false;
+    *result = OBJ_VAL(newListSlice(list, start, end));
+    return true;
+}
+
+// substring(str, início, fim), em bytes. Não copia nem interna a fatia
+// (a não ser que seja curta) até ela ser usada como chave.
+static bool substringNative(int argCount, Value* args, Value* result) {
+    if (!IS_STRING_LIKE(args[0])) {
+        runtimeError("Primeiro argumento de substring deve ser uma string.");
+        return false;
+    }
+    int length;
+    stringContents(args[0], &length);
+    int start, end;
+    if (!sliceBounds(args, length, "substring", &start, &end)) return false;
+    *result = newSubstring(args[0], start, end);
+    return true;
+}
+
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
+    vm.baseFrame = 0;
     vm.openUpvalues = NULL;
 }
 
@@ -243,24 +586,93 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function, int argCount) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function, argCount)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
+// Resolve o nome de uma global para seu índice fixo em vm.globalValues,
+// criando o slot (ainda indefinido) na primeira vez que o nome aparece.
+int globalSlot(ObjString* name) {
+    Value index;
+    if (tableGet(&vm.globalNames, name, &index)) return (int)AS_NUMBER(index);
+
+    push(OBJ_VAL(name));
+    int slot = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    tableSet(&vm.globalNames, name, NUMBER_VAL(slot));
+    pop();
+    return slot;
+}
+
+// Só usado em mensagens de erro, então a busca linear não pesa.
+static ObjString* globalName(int slot) {
+    for (int i = 0; i < vm.globalNames.capacity; i++) {
+        Entry* entry = &vm.globalNames.entries[i];
+        if (entry->key != NULL && (int)AS_NUMBER(entry->value) == slot) return entry->key;
+    }
+    return NULL;
+}
+
 void initVM() {
+    vm.stackCapacity = STACK_INITIAL;
+    vm.stack = (Value*)malloc(sizeof(Value) * vm.stackCapacity);
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+    if (vm.stack == NULL || vm.frames == NULL) exit(1);
+    vm.maxFrames = FRAMES_MAX;
     resetStack();
+    initSimd();
     vm.objects = NULL;
+    vm.youngObjects = NULL;
+    vm.minorGC = false;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.nextFullGC = 4 * 1024 * 1024;
+    vm.bytesAtLastGC = 0;
+    vm.youngBytes = 0;
+    vm.gcDebt = 0;
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
-    initTable(&vm.globals);
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.gcPhase = GC_IDLE;
+    vm.gcRescans = 0;
+    vm.gcPauseBudget = 0;
+    vm.unsweptYoung = NULL;
+    vm.unsweptOld = NULL;
+    vm.minorCollections = 0;
+    vm.fullCollections = 0;
+    vm.gcSlices = 0;
+    vm.gcMaxPause = 0;
+    vm.quickenedCount = 0;
+    vm.deoptimizedCount = 0;
+    initTable(&vm.globalNames);
+    initValueArray(&vm.globalValues);
     initTable(&vm.strings);
 
     vm.initString = NULL;
+    vm.toStringString = NULL;
+    vm.emptyShape = NULL;
+    for (int i = 0; i < OPERATOR_COUNT; i++) {
+        vm.operatorNames[i] = NULL;
+    }
     vm.initString = copyString("init", 4);
+    vm.toStringString = copyString("toString", 8);
+    vm.operatorNames[OPERATOR_ADD] = copyString("__add__", 7);
+    vm.operatorNames[OPERATOR_SUB] = copyString("__sub__", 7);
+    vm.operatorNames[OPERATOR_MUL] = copyString("__mul__", 7);
+    vm.operatorNames[OPERATOR_DIV] = copyString("__div__", 7);
+    vm.operatorNames[OPERATOR_EQ] = copyString("__eq__", 6);
+    vm.operatorNames[OPERATOR_GT] = copyString("__gt__", 6);
+    vm.operatorNames[OPERATOR_LT] = copyString("__lt__", 6);
+    vm.operatorNames[OPERATOR_HASH] = copyString("__hash__", 8);
+    vm.operatorNames[OPERATOR_ITER] = copyString("__iter__", 8);
+    vm.operatorNames[OPERATOR_NEXT] = copyString("__next__", 8);
+    vm.emptyShape = newShape(NULL);
 
     defineNative("clock", clockNative, 0);
     defineNative("exit", exitNative, 1);
@@ -281,13 +693,54 @@ void initVM() {
     defineNative("enumAddValue", enumAddValueNative, 3);
     defineNative("enumGetValue", enumGetValueNative, 2);
     defineNative("enumLength", enumLengthNative, 1);
+    defineNative("f64array", f64arrayNative, 1);
+    defineNative("f64FromList", f64FromListNative, 1);
+    defineNative("f64ToList", f64ToListNative, 1);
+    defineNative("f64Sum", f64SumNative, 1);
+    defineNative("f64Min", f64MinNative, 1);
+    defineNative("f64Max", f64MaxNative, 1);
+    defineNative("f64Dot", f64DotNative, 2);
+    defineNative("f64Axpy", f64AxpyNative, 3);
+    defineNative("f64Scale", f64ScaleNative, 2);
+    defineNative("f64Add", f64AddNative, 2);
+    defineNative("f64Mul", f64MulNative, 2);
+    defineNative("f64PrefixSum", f64PrefixSumNative, 1);
+    defineNative("map", mapNative, 2);
+    defineNative("filter", filterNative, 2);
+    defineNative("reduce", reduceNative, 3);
+    defineNative("forEach", forEachNative, 2);
+    defineNative("sort", sortNative, -1);
+    defineNative("slice", sliceNative, 3);
+    defineNative("substring", substringNative, 3);
 }
 
 void freeVM() {
-    freeTable(&vm.globals);
+    freeTable(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
     freeTable(&vm.strings);
     vm.initString = NULL;
+    vm.toStringString = NULL;
+    vm.emptyShape = NULL;
+    for (int i = 0; i < OPERATOR_COUNT; i++) {
+        vm.operatorNames[i] = NULL;
+    }
     freeObjects();
+    freeSlabs();
+    free(vm.stack);
+    free(vm.frames);
+    vm.stack = NULL;
+    vm.frames = NULL;
+}
+
+void printVMStats() {
+    fprintf(stderr, "-- vm stats\n");
+    fprintf(stderr, "   quickened sites:   %d\n", vm.quickenedCount);
+    fprintf(stderr, "   deoptimized sites: %d\n", vm.deoptimizedCount);
+    fprintf(stderr, "   minor collections: %d\n", vm.minorCollections);
+    fprintf(stderr, "   full collections:  %d\n", vm.fullCollections);
+    fprintf(stderr, "   gc slices:         %d\n", vm.gcSlices);
+    fprintf(stderr, "   max gc pause:      %.0f us\n", vm.gcMaxPause);
+    fprintf(stderr, "   simd kernels:      %s\n", simd.name);
 }
 
 void push(Value value) {
@@ -304,21 +757,57 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
+static void growFrames() {
+    vm.frameCapacity *= 2;
+    if (vm.frameCapacity > vm.maxFrames) vm.frameCapacity = vm.maxFrames;
+    vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity);
+    if (vm.frames == NULL) exit(1);
+}
+
+// Realoca a pilha de valores e corrige os ponteiros que apontam para dentro dela.
+static void ensureStack(int needed) {
+    if (needed <= vm.stackCapacity) return;
+
+    int capacity = vm.stackCapacity;
+    while (capacity < needed) capacity *= 2;
+
+    // Copia em vez de realloc para os ponteiros antigos continuarem válidos
+    // durante a correção.
+    Value* oldStack = vm.stack;
+    vm.stack = (Value*)malloc(sizeof(Value) * capacity);
+    if (vm.stack == NULL) exit(1);
+    memcpy(vm.stack, oldStack, sizeof(Value) * (vm.stackTop - oldStack));
+    vm.stackCapacity = capacity;
+
+    vm.stackTop = vm.stack + (vm.stackTop - oldStack);
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
+    }
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = vm.stack + (upvalue->location - oldStack);
+    }
+    free(oldStack);
+}
+
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.maxFrames) {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    if (vm.frameCount == vm.frameCapacity) growFrames();
+    int slots = (int)(vm.stackTop - vm.stack) - argCount - 1;
+    ensureStack(slots + closure->function->maxStack + FRAME_STACK_RESERVE);
+
     CallFrame* frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm.stack + slots;
     return true;
 }
 
@@ -332,10 +821,6 @@ bool callValue(Value callee, int argCount) {
             }
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
-                // Move os argumentos uma posição para frente
-                for (int i = argCount; i > 0; i--) {
-                    vm.stackTop[-i] = vm.stackTop[-i + 1];
-                }
                 vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
                 Value initializer;
                 if (tableGet(&klass->methods, vm.initString, &initializer)) {
@@ -355,12 +840,19 @@ bool callValue(Value callee, int argCount) {
             }
             case OBJ_NATIVE: {
                 ObjNative* native = AS_NATIVE(callee);
-                if (native->argCount != argCount) {
+                // argCount -1: a nativa confere a quantidade de argumentos.
+                if (native->argCount >= 0 && native->argCount != argCount) {
                     runtimeError("Expected %d arguments but got %d.", native->argCount, argCount);
                     return false;
                 }
+                // Cordas são achatadas aqui, no lugar. Fatias de string passam
+                // direto: quem precisa de ObjString chama flattenString.
+                Value* args = vm.stackTop - argCount;
+                for (int i = 0; i < argCount; i++) {
+                    if (IS_ROPE(args[i])) args[i] = OBJ_VAL(flattenRope(AS_ROPE(args[i])));
+                }
                 Value result;
-                if (!(native->function(argCount, vm.stackTop - argCount, &result))) {
+                if (!(native->function(argCount, args, &result))) {
                     return false;
                 }
                 vm.stackTop -= argCount + 1;
@@ -393,7 +885,7 @@ bool invoke(ObjString* name, int argCount) {
     }
     ObjInstance* instance = AS_INSTANCE(receiver);
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (instanceGetField(instance, name, &value)) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
@@ -443,6 +935,7 @@ static void closeUpvalues(Value* last) {
         ObjUpvalue* upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj*)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
@@ -451,6 +944,11 @@ static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
+    for (int i = 0; i < OPERATOR_COUNT; i++) {
+        if (vm.operatorNames[i] == name) klass->operators[i] = method;
+    }
+    writeBarrier((Obj*)klass, OBJ_VAL(name));
+    writeBarrier((Obj*)klass, method);
     pop();
 }
 
@@ -458,20 +956,78 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Concatena os dois valores string (ou corda) do topo da pilha. Resultados
+// curtos são internados; os longos viram cordas, e anexar à corda mais
+// recente de um buffer não copia o prefixo.
 static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    Value b = peek(0);
+    Value a = peek(1);
+    int aLength, bLength;
+    const char* aChars = stringContents(a, &aLength);
+    stringContents(b, &bLength);
+    int length = aLength + bLength;
+
+    if (length < ROPE_MIN_LENGTH && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* result = allocateString(length);
+        memcpy(result->chars, aChars, aLength);
+        memcpy(result->chars + aLength, AS_STRING(b)->chars, bLength);
+        result = takeString(result);
+        pop();
+        pop();
+        push(OBJ_VAL(result));
+        return;
+    }
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    RopeBuffer* buffer;
+    if (IS_ROPE(a) && AS_ROPE(a)->length == AS_ROPE(a)->buffer->count) {
+        buffer = AS_ROPE(a)->buffer;
+        if (buffer->capacity < length) growRopeBuffer(buffer, length * 2);
+    } else {
+        buffer = newRopeBuffer(length < ROPE_MIN_LENGTH ? ROPE_MIN_LENGTH * 2 : length * 2);
+        aChars = stringContents(a, &aLength);
+        memcpy(buffer->chars, aChars, aLength);
+        buffer->count = aLength;
+    }
 
-    ObjString* result = takeString(chars, length);
+    // b pode ser uma corda do mesmo buffer; os ponteiros só valem depois de crescer.
+    const char* bChars = stringContents(b, &bLength);
+    memcpy(buffer->chars + buffer->count, bChars, bLength);
+    buffer->count = length;
+
+    ObjRope* rope = newRope(buffer, length);
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(OBJ_VAL(rope));
+}
+
+static inline InlineCacheEntry* findCacheEntry(InlineCache* cache, ObjInstance* instance) {
+    for (int i = 0; i < cache->count; i++) {
+        InlineCacheEntry* entry = &cache->entries[i];
+        if (entry->shape == instance->shape && entry->klass == instance->klass) return entry;
+    }
+    return NULL;
+}
+
+static void updateCache(CallFrame* frame, InlineCache* cache, ObjInstance* instance,
+                        ObjShape* transition, int slot, Value method) {
+    // Instâncias em modo dicionário não têm layout estável para cachear.
+    if (instance->shape == NULL) return;
+    rememberObject((Obj*)frame->closure->function);
+
+    InlineCacheEntry* entry = findCacheEntry(cache, instance);
+    if (entry == NULL) {
+        if (cache->count < INLINE_CACHE_SIZE) {
+            entry = &cache->entries[cache->count++];
+        } else {
+            entry = &cache->entries[cache->next];
+            cache->next = (cache->next + 1) % INLINE_CACHE_SIZE;
+        }
+        entry->klass = instance->klass;
+        entry->shape = instance->shape;
+    }
+    entry->transition = transition;
+    entry->slot = slot;
+    entry->method = method;
 }
 
 static InterpretResult handleGetProperty(CallFrame* frame) {
@@ -481,15 +1037,33 @@ static InterpretResult handleGetProperty(CallFrame* frame) {
     }
     ObjInstance* instance = AS_INSTANCE(peek(0));
     ObjString* name = READ_STRING();
+    InlineCache* cache = READ_CACHE();
+
     Value value;
-    if (tableGet(&instance->fields, name, &value)) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot >= 0) {
+            updateCache(frame, cache, instance, NULL, slot, NIL_VAL);
+            pop();
+            push(instance->fields[slot]);
+            return INTERPRET_OK;
+        }
+    } else if (tableGet(&instance->dictionary, name, &value)) {
         pop();
         push(value);
         return INTERPRET_OK;
     }
-    if (!bindMethod(instance->klass, name)) {
+
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
     }
+    updateCache(frame, cache, instance, NULL, -1, method);
+
+    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+    pop();
+    push(OBJ_VAL(bound));
     return INTERPRET_OK;
 }
 
@@ -499,7 +1073,21 @@ static InterpretResult handleSetProperty(CallFrame* frame) {
         return INTERPRET_RUNTIME_ERROR;
     }
     ObjInstance* instance = AS_INSTANCE(peek(1));
-    tableSet(&instance->fields, READ_STRING(), peek(0));
+    ObjString* name = READ_STRING();
+    InlineCache* cache = READ_CACHE();
+
+    ObjShape* before = instance->shape;
+    instanceSetField(instance, name, peek(0));
+    if (before != NULL && instance->shape != NULL) {
+        // O cache é indexado pela shape de antes do SET; se o campo foi
+        // adicionado, a entrada guarda também a transição.
+        ObjShape* after = instance->shape;
+        int slot = shapeSlot(after, name);
+        instance->shape = before;
+        updateCache(frame, cache, instance, after != before ? after : NULL, slot, NIL_VAL);
+        instance->shape = after;
+    }
+
     Value value = pop();
     pop();
     push(value);
@@ -507,29 +1095,25 @@ static InterpretResult handleSetProperty(CallFrame* frame) {
 }
 
 static InterpretResult handleAdd(CallFrame* frame) {
-    Value b = pop();
-    Value a = pop();
-    if (IS_STRING(a) && IS_STRING(b)) {
-        push(a);
-        push(b);
+    Value b = peek(0);
+    Value a = peek(1);
+    if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b)) {
         concatenate();
         return INTERPRET_OK;
     } 
-    else if (IS_STRING(a)) {
-        Value bStr = valueToString(b);
-        push(a);
-        push(bStr);
+    else if (IS_STRING_LIKE(a) || IS_STRING_LIKE(b)) {
+        // Os operandos ficam na pilha enquanto a conversão aloca ou roda
+        // toString(); a pilha pode mudar de lugar nesse meio-tempo.
+        int slot = IS_STRING_LIKE(a) ? 1 : 2;
+        Value string;
+        if (!vmToString(slot == 1 ? b : a, &string)) return INTERPRET_RUNTIME_ERROR;
+        vm.stackTop[-slot] = string;
         concatenate();
         return INTERPRET_OK;
     }
-    else if (IS_STRING(b)) {
-        Value aStr = valueToString(a);
-        push(aStr);
-        push(b);
-        concatenate();
-        return INTERPRET_OK;
-    }
-    else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    pop();
+    pop();
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
         push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
         return INTERPRET_OK;
     }
@@ -539,13 +1123,11 @@ static InterpretResult handleAdd(CallFrame* frame) {
     }
     else if (IS_INSTANCE(a)) {
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__add__", 7);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
-            push(a); 
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+        Value method = instance->klass->operators[OPERATOR_ADD];
+        if (!IS_NIL(method)) {
+            push(a);
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             runtimeError("Classe '%s' não implementa operador '+' (__add__).", instance->klass->name->chars);
             return INTERPRET_RUNTIME_ERROR;
@@ -570,13 +1152,11 @@ static InterpretResult handleSubtract(CallFrame* frame) {
     }
     else if (IS_INSTANCE(a)) {
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__sub__", 7);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
-            push(a); 
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+        Value method = instance->klass->operators[OPERATOR_SUB];
+        if (!IS_NIL(method)) {
+            push(a);
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             runtimeError("Classe '%s' não implementa operador '-' (__sub__).", instance->klass->name->chars);
             return INTERPRET_RUNTIME_ERROR;
@@ -605,13 +1185,11 @@ static InterpretResult handleMultiply(CallFrame* frame) {
     else if (IS_INSTANCE(a)) {
 
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__mul__", 7);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
+        Value method = instance->klass->operators[OPERATOR_MUL];
+        if (!IS_NIL(method)) {
             push(a);
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             runtimeError("Classe '%s' não implementa operador '*' (__mul__).", instance->klass->name->chars);
             return INTERPRET_RUNTIME_ERROR;
@@ -644,13 +1222,11 @@ static InterpretResult handleDivide(CallFrame* frame) {
     else if (IS_INSTANCE(a)) {
      
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__div__", 7);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
-            push(a); 
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+        Value method = instance->klass->operators[OPERATOR_DIV];
+        if (!IS_NIL(method)) {
+            push(a);
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             runtimeError("Classe '%s' não implementa operador '/' (__div__).", instance->klass->name->chars);
             return INTERPRET_RUNTIME_ERROR;
@@ -662,47 +1238,44 @@ static InterpretResult handleDivide(CallFrame* frame) {
     }
 }
 
-static InterpretResult handleCall(CallFrame* frame) {
+static InterpretResult handleInvoke(CallFrame* frame) {
+    ObjString* name = READ_STRING();
     int argCount = READ_BYTE();
-    Value callee = peek(argCount);
-    if (!callValue(callee, argCount)) {
+    InlineCache* cache = READ_CACHE();
+
+    Value receiver = peek(argCount);
+    if (!IS_INSTANCE(receiver)) {
+        runtimeError("Only instances have methods.");
         return INTERPRET_RUNTIME_ERROR;
     }
-    frame = &vm.frames[vm.frameCount - 1];
-    return INTERPRET_OK;
-}
+    ObjInstance* instance = AS_INSTANCE(receiver);
 
-static InterpretResult handleInvoke(CallFrame* frame) {
-    ObjString* method = READ_STRING();
-    int argCount = READ_BYTE();
-    if (!invoke(method, argCount)) {
+    Value value;
+    if (instanceGetField(instance, name, &value)) {
+        vm.stackTop[-argCount - 1] = value;
+        return callValue(value, argCount) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+    }
+
+    Value method;
+    if (!tableGet(&instance->klass->methods, name, &method)) {
+        runtimeError("Undefined property '%s'.", name->chars);
         return INTERPRET_RUNTIME_ERROR;
     }
-    frame = &vm.frames[vm.frameCount - 1];
-    return INTERPRET_OK;
+    updateCache(frame, cache, instance, NULL, -1, method);
+    return call(AS_CLOSURE(method), argCount) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
 }
 
 static InterpretResult handleSuperInvoke(CallFrame* frame) {
     ObjString* method = READ_STRING();
     int argCount = READ_BYTE();
-    ObjClass* superclass = AS_CLASS(pop());
-    if (!invokeFromClass(superclass, method, argCount)) {
+    Value superclass = pop();
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
     }
-    frame = &vm.frames[vm.frameCount - 1];
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleReturn(CallFrame* frame) {
-    Value result = pop();
-    closeUpvalues(frame->slots);
-    vm.frameCount--;
-    if (vm.frameCount == 0) {
-        pop();
-        return INTERPRET_OK;
+    if (!invokeFromClass(AS_CLASS(superclass), method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
     }
-    vm.stackTop = frame->slots;
-    push(result);
     frame = &vm.frames[vm.frameCount - 1];
     return INTERPRET_OK;
 }
@@ -719,89 +1292,24 @@ static InterpretResult handleClosure(CallFrame* frame) {
         } else {
             closure->upvalues[i] = frame->closure->upvalues[index];
         }
+        writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
     }
     return INTERPRET_OK;
 }
 
-static InterpretResult handleGetGlobal(CallFrame* frame) {
-    ObjString* name = READ_STRING();
-    Value value;
-    if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
-    }
-    push(value);
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleSetGlobal(CallFrame* frame) {
+static InterpretResult handleGetSuper(CallFrame* frame) {
     ObjString* name = READ_STRING();
-    if (tableSet(&vm.globals, name, peek(0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
+    Value superclass = pop();
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
     }
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleDefineGlobal(CallFrame* frame) {
-    ObjString* name = READ_STRING();
-    tableSet(&vm.globals, name, peek(0));
-    pop();
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleGetLocal(CallFrame* frame) {
-    uint8_t slot = READ_BYTE();
-    push(frame->slots[slot]);
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleSetLocal(CallFrame* frame) {
-    uint8_t slot = READ_BYTE();
-    frame->slots[slot] = peek(0);
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleGetUpvalue(CallFrame* frame) {
-    uint8_t slot = READ_BYTE();
-    push(*frame->closure->upvalues[slot]->location);
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleSetUpvalue(CallFrame* frame) {
-    uint8_t slot = READ_BYTE();
-    *frame->closure->upvalues[slot]->location = peek(0);
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleGetSuper(CallFrame* frame) {
-    ObjString* name = READ_STRING();
-    ObjClass* superclass = AS_CLASS(pop());
-    if (!bindMethod(superclass, name)) {
+    if (!bindMethod(AS_CLASS(superclass), name)) {
         return INTERPRET_RUNTIME_ERROR;
     }
     return INTERPRET_OK;
 }
 
-static InterpretResult handleJump(CallFrame* frame) {
-    uint16_t offset = READ_SHORT();
-    frame->ip += offset;
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleJumpIfFalse(CallFrame* frame) {
-    uint16_t offset = READ_SHORT();
-    if (isFalsey(peek(0))) frame->ip += offset;
-    return INTERPRET_OK;
-}
-
-static InterpretResult handleLoop(CallFrame* frame) {
-    uint16_t offset = READ_SHORT();
-    frame->ip -= offset;
-    return INTERPRET_OK;
-}
-
 static InterpretResult handleEqual(CallFrame* frame) {
     Value b = pop();
     Value a = pop();
@@ -818,19 +1326,17 @@ static InterpretResult handleEqual(CallFrame* frame) {
         push(BOOL_VAL(true));
         return INTERPRET_OK;
     }
-    else if (IS_STRING(a) && IS_STRING(b)) {
-        push(BOOL_VAL(AS_STRING(a) == AS_STRING(b)));
+    else if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b)) {
+        push(BOOL_VAL(stringsEqual(a, b)));
         return INTERPRET_OK;
     }
     else if (IS_INSTANCE(a)) {
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__eq__", 6);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
-            push(a); 
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+        Value method = instance->klass->operators[OPERATOR_EQ];
+        if (!IS_NIL(method)) {
+            push(a);
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             push(BOOL_VAL(valuesEqual(a, b)));
             return INTERPRET_OK;
@@ -851,13 +1357,11 @@ static InterpretResult handleGreater(CallFrame* frame) {
     }
     else if (IS_INSTANCE(a)) {
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__gt__", 6);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
-            push(a); 
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+        Value method = instance->klass->operators[OPERATOR_GT];
+        if (!IS_NIL(method)) {
+            push(a);
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             runtimeError("Classe '%s' não implementa operador '>' (__gt__).", instance->klass->name->chars);
             return INTERPRET_RUNTIME_ERROR;
@@ -878,13 +1382,11 @@ static InterpretResult handleLess(CallFrame* frame) {
     }
     else if (IS_INSTANCE(a)) {
         ObjInstance* instance = AS_INSTANCE(a);
-        ObjString* methodName = copyString("__lt__", 6);
-        Value method;
-        if (tableGet(&instance->klass->methods, methodName, &method)) {
-            push(a); 
-            push(b); 
-            callValue(method, 1);
-            return INTERPRET_OK;
+        Value method = instance->klass->operators[OPERATOR_LT];
+        if (!IS_NIL(method)) {
+            push(a);
+            push(b);
+            return callValue(method, 1) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
         } else {
             runtimeError("Classe '%s' não implementa operador '<' (__lt__).", instance->klass->name->chars);
             return INTERPRET_RUNTIME_ERROR;
@@ -896,272 +1398,1031 @@ static InterpretResult handleLess(CallFrame* frame) {
     }
 }
 
+// Índice inteiro dentro de [0, count), ou -1.
+static inline int listIndex(Value index, int count) {
+    if (!IS_NUMBER(index)) return -1;
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < count) || (int)number != number) return -1;
+    return (int)number;
+}
+
+static InterpretResult handleIndexGet(CallFrame* frame) {
+    Value index = peek(0);
+    Value container = peek(1);
+    if (IS_LIST(container)) {
+        ObjList* list = AS_LIST(container);
+        int i = listIndex(index, list->count);
+        if (i < 0) {
+            runtimeError("Índice de lista inválido ou fora dos limites.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        vm.stackTop -= 2;
+        push(listValues(list)[i]);
+        return INTERPRET_OK;
+    }
+    if (IS_DICT(container)) {
+        Value value;
+        if (!dictGet(AS_DICT(container), index, &value)) return INTERPRET_RUNTIME_ERROR;
+        vm.stackTop -= 2;
+        push(value);
+        return INTERPRET_OK;
+    }
+    if (IS_F64ARRAY(container)) {
+        ObjF64Array* array = AS_F64ARRAY(container);
+        int i = listIndex(index, array->count);
+        if (i < 0) {
+            runtimeError("Índice de f64array inválido ou fora dos limites.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        vm.stackTop -= 2;
+        push(NUMBER_VAL(array->values[i]));
+        return INTERPRET_OK;
+    }
+    runtimeError("Só listas, dicionários e f64arrays podem ser indexados.");
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+static InterpretResult handleIndexSet(CallFrame* frame) {
+    Value value = peek(0);
+    Value index = peek(1);
+    Value container = peek(2);
+    if (IS_LIST(container)) {
+        ObjList* list = AS_LIST(container);
+        int i = listIndex(index, list->count);
+        if (i < 0) {
+            runtimeError("Índice de lista inválido ou fora dos limites.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        listSet(list, i, value);
+    } else if (IS_DICT(container)) {
+        if (!dictSet(AS_DICT(container), index, value)) return INTERPRET_RUNTIME_ERROR;
+    } else if (IS_F64ARRAY(container)) {
+        ObjF64Array* array = AS_F64ARRAY(container);
+        int i = listIndex(index, array->count);
+        if (i < 0) {
+            runtimeError("Índice de f64array inválido ou fora dos limites.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        if (!IS_NUMBER(value)) {
+            runtimeError("Só números podem ser guardados num f64array.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        array->values[i] = AS_NUMBER(value);
+    } else {
+        runtimeError("Só listas, dicionários e f64arrays podem ser indexados.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.stackTop -= 3;
+    push(value);
+    return INTERPRET_OK;
+}
+
+static bool hasSpecialMethod(Value value, OperatorSlot slot) {
+    return IS_INSTANCE(value) && !IS_NIL(AS_INSTANCE(value)->klass->operators[slot]);
+}
+
+// Deixa [iterável, estado] na pilha. Instâncias com __iter__ são trocadas
+// pelo iterador que ele devolve; sem __iter__, a própria instância precisa
+// ter __next__.
+// Em dicionários e enums o estado também guarda a versão da coleção, para
+// OP_ITER_NEXT perceber quando as entradas mudaram de posição. Os dois cabem
+// inteiros num double: posição nos 31 bits baixos, versão (módulo 2^22) acima.
+#define ITER_POSITION_BITS 31
+#define ITER_VERSION_MASK ((1u << 22) - 1)
+#define ITER_STATE_LIMIT 9007199254740992.0   // 2^53
+
+static inline Value iterState(int position, uint32_t version) {
+    return NUMBER_VAL((double)(((uint64_t)(version & ITER_VERSION_MASK) << ITER_POSITION_BITS) |
+                               (uint64_t)position));
+}
+
+static InterpretResult handleIterInit(CallFrame* frame) {
+    Value sequence = peek(0);
+    if (IS_DICT(sequence)) {
+        push(iterState(0, AS_DICT(sequence)->version));
+        return INTERPRET_OK;
+    }
+    if (IS_ENUM(sequence)) {
+        push(iterState(0, AS_ENUM(sequence)->version));
+        return INTERPRET_OK;
+    }
+    if (IS_LIST(sequence) || IS_F64ARRAY(sequence)) {
+        push(NUMBER_VAL(0));
+        return INTERPRET_OK;
+    }
+
+    if (hasSpecialMethod(sequence, OPERATOR_ITER)) {
+        Value iterator;
+        if (!callWithReceiver(sequence, AS_INSTANCE(sequence)->klass->operators[OPERATOR_ITER],
+                              0, NULL, &iterator)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        vm.stackTop[-1] = iterator;
+        sequence = iterator;
+    } else if (!IS_INSTANCE(sequence)) {
+        runtimeError("Só listas, dicionários, enums, f64arrays e instâncias com __iter__/__next__ "
+                     "podem ser percorridos.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (!hasSpecialMethod(sequence, OPERATOR_NEXT)) {
+        runtimeError("Iterador precisa de um método __next__.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    push(NUMBER_VAL(0));
+    return INTERPRET_OK;
+}
+
+// O estado é a próxima posição: índice em listas e f64arrays, entrada em
+// dicionários (na ordem de inserção) e slot da tabela em enums, estes dois
+// junto com a versão (ver iterState). Com duas
+// variáveis, empilha índice/chave/nome e o valor.
+static InterpretResult handleIterNext(CallFrame* frame) {
+    int slot = READ_BYTE();
+    int varCount = READ_BYTE();
+    int exitOffset = READ_SHORT();
+    Value sequence = frame->slots[slot];
+    Value state = frame->slots[slot + 1];
+    // Só um .loxc adulterado chega aqui com outro estado.
+    if (!IS_NUMBER(state) || !(AS_NUMBER(state) >= 0 && AS_NUMBER(state) < ITER_STATE_LIMIT) ||
+        (!IS_LIST(sequence) && !IS_F64ARRAY(sequence) && !IS_DICT(sequence) &&
+         !IS_ENUM(sequence) && !IS_INSTANCE(sequence))) {
+        runtimeError("Estado de for-in inválido.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    uint64_t packed = (uint64_t)AS_NUMBER(state);
+    int position = (int)(packed & INT_MAX);
+    uint32_t version = (uint32_t)(packed >> ITER_POSITION_BITS);
+    if ((IS_LIST(sequence) || IS_F64ARRAY(sequence)) && version != 0) {
+        runtimeError("Estado de for-in inválido.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    if (IS_LIST(sequence)) {
+        ObjList* list = AS_LIST(sequence);
+        if (position < list->count) {
+            if (varCount == 2) push(NUMBER_VAL(position));
+            push(listValues(list)[position]);
+            position++;
+        } else {
+            frame->ip += exitOffset;
+        }
+    } else if (IS_F64ARRAY(sequence)) {
+        ObjF64Array* array = AS_F64ARRAY(sequence);
+        if (position < array->count) {
+            if (varCount == 2) push(NUMBER_VAL(position));
+            push(NUMBER_VAL(array->values[position]));
+            position++;
+        } else {
+            frame->ip += exitOffset;
+        }
+    } else if (IS_DICT(sequence)) {
+        ObjDict* dict = AS_DICT(sequence);
+        // Apagar ou inserir chaves pode compactar as entradas; seguir com a
+        // posição antiga pularia chaves sem aviso.
+        if (version != (dict->version & ITER_VERSION_MASK)) {
+            runtimeError("Dicionário reorganizado durante o for-in; altere as chaves depois do laço.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        while (position < dict->used && IS_UNDEFINED(dict->entries[position].key)) position++;
+        if (position < dict->used) {
+            push(dict->entries[position].key);
+            if (varCount == 2) push(dict->entries[position].value);
+            position++;
+        } else {
+            frame->ip += exitOffset;
+        }
+    } else if (IS_ENUM(sequence)) {
+        ObjEnum* enumObj = AS_ENUM(sequence);
+        if (version != (enumObj->version & ITER_VERSION_MASK)) {
+            runtimeError("Enum redimensionado durante o for-in.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        Table* values = &enumObj->values;
+        while (position < values->capacity && values->entries[position].key == NULL) position++;
+        if (position < values->capacity) {
+            push(OBJ_VAL(values->entries[position].key));
+            if (varCount == 2) push(values->entries[position].value);
+            position++;
+        } else {
+            frame->ip += exitOffset;
+        }
+    } else {
+        if (varCount == 2) {
+            runtimeError("Iteradores de instância só aceitam uma variável no for-in.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        // __next__ devolve nil quando acaba. A chamada pode realocar a pilha
+        // e os frames, então frame é relido depois.
+        Value next;
+        if (!callWithReceiver(sequence, AS_INSTANCE(sequence)->klass->operators[OPERATOR_NEXT],
+                              0, NULL, &next)) {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        if (IS_NIL(next)) {
+            frame->ip += exitOffset;
+        } else {
+            push(next);
+        }
+        return INTERPRET_OK;
+    }
+    frame->slots[slot + 1] = IS_DICT(sequence) || IS_ENUM(sequence) ? iterState(position, version)
+                                                                    : NUMBER_VAL(position);
+    return INTERPRET_OK;
+}
+
+// Um site que desotimizou QUICKEN_LIMIT vezes fica no opcode genérico, em
+// vez de alternar para sempre entre as duas versões. Os contadores do
+// --stats contam cada site uma vez só.
+#define QUICKEN_LIMIT 4
+
+static inline void quicken(CallFrame* frame, uint8_t* site, uint8_t op) {
+    Chunk* chunk = &frame->closure->function->chunk;
+    int deopts = chunk->deopts == NULL ? 0 : chunk->deopts[site - chunk->code];
+    if (deopts >= QUICKEN_LIMIT) return;
+    if (deopts == 0) vm.quickenedCount++;
+    *site = op;
+}
+
+// calloc direto: reallocate() poderia disparar o GC com ip e stackTop
+// ainda nas variáveis locais de run().
+static void deoptimize(CallFrame* frame, uint8_t* site, uint8_t op) {
+    Chunk* chunk = &frame->closure->function->chunk;
+    if (chunk->deopts == NULL) {
+        chunk->deopts = calloc((size_t)chunk->count, sizeof(uint8_t));
+        if (chunk->deopts == NULL) exit(1);
+    }
+    uint8_t* deopts = &chunk->deopts[site - chunk->code];
+    if (*deopts == 0) vm.deoptimizedCount++;
+    if (*deopts < QUICKEN_LIMIT) (*deopts)++;
+    *site = op;
+}
+
 static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* stackTop;
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_CONSTANT_16
+#undef READ_STRING
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+        (ip += 2, (uint16_t)((ip[-2] << 8 | ip[-1])))
+#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_16() (frame->closure->function->chunk.constants.values[READ_SHORT()])
+#define READ_STRING() AS_STRING(READ_CONSTANT_16())
+
+// Leitura de operandos sem avançar ip, para os caminhos com inline cache.
+#define OPERAND_SHORT(offset) ((uint16_t)(ip[offset] << 8 | ip[(offset) + 1]))
+#define CACHE_AT(offset) (&frame->closure->function->chunk.caches[OPERAND_SHORT(offset)])
+
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+
+// ip e stackTop vivem em variáveis locais; antes de qualquer código que
+// aloque, chame funções ou reporte erros eles precisam voltar para o VM.
+#define SAVE_STATE() (frame->ip = ip, vm.stackTop = stackTop)
+#define LOAD_FRAME() \
+    do { \
+        frame = &vm.frames[vm.frameCount - 1]; \
+        ip = frame->ip; \
+    } while (false)
+#define LOAD_STATE() \
+    do { \
+        LOAD_FRAME(); \
+        stackTop = vm.stackTop; \
+    } while (false)
+
+#define SLOW_PATH(handler) \
+    do { \
+        SAVE_STATE(); \
+        InterpretResult result = handler(frame); \
+        if (result != INTERPRET_OK) return result; \
+        LOAD_STATE(); \
+    } while (false)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        SAVE_STATE(); \
+        runtimeError(__VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+// Quickening: a primeira execução de um opcode genérico reescreve o byte
+// em ip[-1] para a versão especializada no tipo observado. A versão
+// especializada volta ao genérico (deotimiza) quando o tipo muda.
+#define QUICKEN(op)     quicken(frame, ip - 1, (op))
+#define DEOPTIMIZE(op)  deoptimize(frame, ip - 1, (op))
+
+#define BINARY_OP(valueType, op, quickened, handler) \
+    do { \
+        Value b = PEEK(0); \
+        Value a = PEEK(1); \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            QUICKEN(quickened); \
+            stackTop--; \
+            stackTop[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } else { \
+            SLOW_PATH(handler); \
+        } \
+    } while (false)
 
-#define BINARY_OP(valueType, op) \
+#define QUICKENED_OP(valueType, op, generic, handler) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            if (IS_LIST(peek(0)) || IS_LIST(peek(1))) { \
-                runtimeError("Operações aritméticas não suportam listas."); \
+        Value b = PEEK(0); \
+        Value a = PEEK(1); \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            stackTop--; \
+            stackTop[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } else { \
+            DEOPTIMIZE(generic); \
+            SLOW_PATH(handler); \
+        } \
+    } while (false)
+
+// Superinstruções (ver optimizer.c): o caminho rápido consome a sequência
+// inteira; o lento executa só a primeira instrução original e deixa ip
+// apontando para o restante da sequência, que continua intacto no chunk.
+#define COMPARE_JUMP(op, handler) \
+    do { \
+        Value b = PEEK(0); \
+        Value a = PEEK(1); \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            stackTop -= 2; \
+            if (AS_NUMBER(a) op AS_NUMBER(b)) { \
+                ip += 4; \
             } else { \
-                runtimeError("Operands must be numbers."); \
+                PUSH(BOOL_VAL(false)); \
+                ip += 3 + (uint16_t)(ip[1] << 8 | ip[2]); \
             } \
-            return INTERPRET_RUNTIME_ERROR; \
+        } else { \
+            SLOW_PATH(handler); \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
     } while (false)
 
-    for (;;) {
-        if (vm.frameCount == 0) {
-            return INTERPRET_OK;
+#define NEGATED_COMPARE(op, handler) \
+    do { \
+        Value b = PEEK(0); \
+        Value a = PEEK(1); \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            stackTop--; \
+            stackTop[-1] = BOOL_VAL(!(AS_NUMBER(a) op AS_NUMBER(b))); \
+            ip++; \
+        } else { \
+            SLOW_PATH(handler); \
+        } \
+    } while (false)
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [OP_CONSTANT]      = &&op_OP_CONSTANT,
+        [OP_CONSTANT_16]   = &&op_OP_CONSTANT_16,
+        [OP_INTEGER]       = &&op_OP_INTEGER,
+        [OP_INTEGER_16]    = &&op_OP_INTEGER_16,
+        [OP_NIL]           = &&op_OP_NIL,
+        [OP_TRUE]          = &&op_OP_TRUE,
+        [OP_FALSE]         = &&op_OP_FALSE,
+        [OP_MINUS_ONE]     = &&op_OP_MINUS_ONE,
+        [OP_ZERO]          = &&op_OP_ZERO,
+        [OP_ONE]           = &&op_OP_ONE,
+        [OP_POP]           = &&op_OP_POP,
+        [OP_GET_LOCAL]     = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL]     = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL_SLOT] = &&op_OP_GET_GLOBAL_SLOT,
+        [OP_SET_GLOBAL_SLOT] = &&op_OP_SET_GLOBAL_SLOT,
+        [OP_GET_UPVALUE]   = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE]   = &&op_OP_SET_UPVALUE,
+        [OP_SET_PROPERTY]  = &&op_OP_SET_PROPERTY,
+        [OP_GET_SUPER]     = &&op_OP_GET_SUPER,
+        [OP_GET_PROPERTY]  = &&op_OP_GET_PROPERTY,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_EQUAL]         = &&op_OP_EQUAL,
+        [OP_GREATER]       = &&op_OP_GREATER,
+        [OP_LESS]          = &&op_OP_LESS,
+        [OP_ADD]           = &&op_OP_ADD,
+        [OP_SUBTRACT]      = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY]      = &&op_OP_MULTIPLY,
+        [OP_DIVIDE]        = &&op_OP_DIVIDE,
+        [OP_NOT]           = &&op_OP_NOT,
+        [OP_NEGATE]        = &&op_OP_NEGATE,
+        [OP_PRINT]         = &&op_OP_PRINT,
+        [OP_JUMP]          = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP]          = &&op_OP_LOOP,
+        [OP_CALL]          = &&op_OP_CALL,
+        [OP_TAIL_CALL]     = &&op_OP_TAIL_CALL,
+        [OP_INVOKE]        = &&op_OP_INVOKE,
+        [OP_SUPER_INVOKE]  = &&op_OP_SUPER_INVOKE,
+        [OP_CLOSURE]       = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_RETURN]        = &&op_OP_RETURN,
+        [OP_CLASS]         = &&op_OP_CLASS,
+        [OP_INHERIT]       = &&op_OP_INHERIT,
+        [OP_METHOD]        = &&op_OP_METHOD,
+        [OP_ADD_LOCALS]    = &&op_OP_ADD_LOCALS,
+        [OP_LESS_JUMP]     = &&op_OP_LESS_JUMP,
+        [OP_GREATER_JUMP]  = &&op_OP_GREATER_JUMP,
+        [OP_NOT_EQUAL]     = &&op_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL]    = &&op_OP_LESS_EQUAL,
+        [OP_ADD_NUM]       = &&op_OP_ADD_NUM,
+        [OP_ADD_STR]       = &&op_OP_ADD_STR,
+        [OP_SUBTRACT_NUM]  = &&op_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM]  = &&op_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM]    = &&op_OP_DIVIDE_NUM,
+        [OP_LESS_NUM]      = &&op_OP_LESS_NUM,
+        [OP_GREATER_NUM]   = &&op_OP_GREATER_NUM,
+        [OP_BUILD_LIST]    = &&op_OP_BUILD_LIST,
+        [OP_INDEX_GET]     = &&op_OP_INDEX_GET,
+        [OP_INDEX_SET]     = &&op_OP_INDEX_SET,
+        [OP_ITER_INIT]     = &&op_OP_ITER_INIT,
+        [OP_ITER_NEXT]     = &&op_OP_ITER_NEXT,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     op_##name
+#define DISPATCH()     goto *dispatchTable[READ_BYTE()]
+#else
+#define INTERPRET_LOOP dispatch: switch (READ_BYTE())
+#define CASE(name)     case name
+#define DISPATCH()     goto dispatch
+#endif
+
+    LOAD_STATE();
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT):    PUSH(READ_CONSTANT());         DISPATCH();
+        CASE(OP_CONSTANT_16): PUSH(READ_CONSTANT_16());      DISPATCH();
+        CASE(OP_INTEGER):     PUSH(NUMBER_VAL(READ_BYTE()));  DISPATCH();
+        CASE(OP_INTEGER_16):  PUSH(NUMBER_VAL(READ_SHORT())); DISPATCH();
+        CASE(OP_NIL):         PUSH(NIL_VAL);                  DISPATCH();
+        CASE(OP_TRUE):        PUSH(BOOL_VAL(true));           DISPATCH();
+        CASE(OP_FALSE):       PUSH(BOOL_VAL(false));          DISPATCH();
+        CASE(OP_MINUS_ONE):   PUSH(NUMBER_VAL(-1));           DISPATCH();
+        CASE(OP_ZERO):        PUSH(NUMBER_VAL(0));            DISPATCH();
+        CASE(OP_ONE):         PUSH(NUMBER_VAL(1));            DISPATCH();
+        CASE(OP_POP):         stackTop--;                     DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(frame->slots[slot]);
+            DISPATCH();
         }
-        
-        frame = &vm.frames[vm.frameCount - 1];
-        
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT:    push(READ_CONSTANT());    break;
-            case OP_CONSTANT_16: push(READ_CONSTANT_16()); break;
-            case OP_INTEGER:    push(NUMBER_VAL(READ_BYTE()));  break;
-            case OP_INTEGER_16: push(NUMBER_VAL(READ_SHORT())); break;
-            case OP_NIL:        push(NIL_VAL);                  break;
-            case OP_TRUE:       push(BOOL_VAL(true));           break;
-            case OP_FALSE:      push(BOOL_VAL(false));          break;
-            case OP_MINUS_ONE:  push(NUMBER_VAL(-1));           break;
-            case OP_ZERO:       push(NUMBER_VAL(0));            break;
-            case OP_ONE:        push(NUMBER_VAL(1));            break;
-            case OP_POP:        pop(); break;
-            case OP_GET_LOCAL: {
-                InterpretResult result = handleGetLocal(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
-            }
-            case OP_SET_LOCAL: {
-                InterpretResult result = handleSetLocal(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
             }
-            case OP_GET_GLOBAL: {
-                InterpretResult result = handleGetGlobal(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", globalName(slot)->chars);
             }
-            case OP_SET_GLOBAL: {
-                InterpretResult result = handleSetGlobal(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            vm.globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+            *upvalue->location = PEEK(0);
+            writeBarrier((Obj*)upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            Value receiver = PEEK(0);
+            if (IS_INSTANCE(receiver)) {
+                ObjInstance* instance = AS_INSTANCE(receiver);
+                InlineCacheEntry* entry = findCacheEntry(CACHE_AT(2), instance);
+                if (entry != NULL && entry->slot >= 0) {
+                    stackTop[-1] = instance->fields[entry->slot];
+                    ip += 4;
+                    DISPATCH();
+                }
             }
-            case OP_DEFINE_GLOBAL: {
-                InterpretResult result = handleDefineGlobal(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            SLOW_PATH(handleGetProperty);
+            DISPATCH();
+        }
+        CASE(OP_SET_PROPERTY): {
+            Value receiver = PEEK(1);
+            if (IS_INSTANCE(receiver)) {
+                ObjInstance* instance = AS_INSTANCE(receiver);
+                InlineCacheEntry* entry = findCacheEntry(CACHE_AT(2), instance);
+                if (entry != NULL && entry->slot >= 0 &&
+                    (entry->transition == NULL || entry->slot < instance->fieldCapacity)) {
+                    Value value = POP();
+                    instance->fields[entry->slot] = value;
+                    writeBarrier((Obj*)instance, value);
+                    if (entry->transition != NULL) instance->shape = entry->transition;
+                    stackTop[-1] = value;
+                    ip += 4;
+                    DISPATCH();
+                }
             }
-            case OP_GET_UPVALUE: {
-                InterpretResult result = handleGetUpvalue(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            SLOW_PATH(handleSetProperty);
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER):    SLOW_PATH(handleGetSuper);    DISPATCH();
+        CASE(OP_EQUAL): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                stackTop--;
+                stackTop[-1] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+            } else {
+                SLOW_PATH(handleEqual);
             }
-            case OP_SET_UPVALUE: {
-                InterpretResult result = handleSetUpvalue(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM, handleGreater);    DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM, handleLess);          DISPATCH();
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM, handleSubtract); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM, handleMultiply); DISPATCH();
+        CASE(OP_ADD): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                QUICKEN(OP_ADD_NUM);
+                stackTop--;
+                stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else {
+                if (IS_STRING_LIKE(a) && IS_STRING_LIKE(b)) QUICKEN(OP_ADD_STR);
+                SLOW_PATH(handleAdd);
             }
-            case OP_GET_PROPERTY: {
-                InterpretResult result = handleGetProperty(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_DIVIDE): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            if (IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(b) != 0.0) {
+                QUICKEN(OP_DIVIDE_NUM);
+                stackTop--;
+                stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+            } else {
+                SLOW_PATH(handleDivide);
             }
-            case OP_SET_PROPERTY: {
-                InterpretResult result = handleSetProperty(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM):      QUICKENED_OP(NUMBER_VAL, +, OP_ADD, handleAdd);           DISPATCH();
+        CASE(OP_SUBTRACT_NUM): QUICKENED_OP(NUMBER_VAL, -, OP_SUBTRACT, handleSubtract); DISPATCH();
+        CASE(OP_MULTIPLY_NUM): QUICKENED_OP(NUMBER_VAL, *, OP_MULTIPLY, handleMultiply); DISPATCH();
+        CASE(OP_LESS_NUM):     QUICKENED_OP(BOOL_VAL, <, OP_LESS, handleLess);           DISPATCH();
+        CASE(OP_GREATER_NUM):  QUICKENED_OP(BOOL_VAL, >, OP_GREATER, handleGreater);     DISPATCH();
+        CASE(OP_DIVIDE_NUM): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            if (IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(b) != 0.0) {
+                stackTop--;
+                stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+            } else {
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) DEOPTIMIZE(OP_DIVIDE);
+                SLOW_PATH(handleDivide);
             }
-            case OP_GET_SUPER: {
-                InterpretResult result = handleGetSuper(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR): {
+            if (IS_STRING_LIKE(PEEK(0)) && IS_STRING_LIKE(PEEK(1))) {
+                SAVE_STATE();
+                concatenate();
+                stackTop = vm.stackTop;
+            } else {
+                DEOPTIMIZE(OP_ADD);
+                SLOW_PATH(handleAdd);
             }
-            case OP_EQUAL: {
-                InterpretResult result = handleEqual(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            DISPATCH();
+        }
+        CASE(OP_BUILD_LIST): {
+            int count = READ_BYTE();
+            SAVE_STATE();
+            ObjList* list = newListFrom(stackTop - count, count);
+            stackTop -= count;
+            PUSH(OBJ_VAL(list));
+            DISPATCH();
+        }
+        CASE(OP_INDEX_GET): {
+            Value index = PEEK(0);
+            Value container = PEEK(1);
+            if (IS_LIST(container)) {
+                ObjList* list = AS_LIST(container);
+                int i = listIndex(index, list->count);
+                if (i >= 0) {
+                    stackTop--;
+                    stackTop[-1] = listValues(list)[i];
+                    DISPATCH();
+                }
             }
-            case OP_GREATER: {
-                InterpretResult result = handleGreater(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            SLOW_PATH(handleIndexGet);
+            DISPATCH();
+        }
+        CASE(OP_INDEX_SET): {
+            Value value = PEEK(0);
+            Value index = PEEK(1);
+            Value container = PEEK(2);
+            if (IS_LIST(container)) {
+                ObjList* list = AS_LIST(container);
+                int i = listIndex(index, list->count);
+                if (i >= 0 && list->base == NULL) {
+                    list->values[i] = value;
+                    writeBarrier((Obj*)list, value);
+                    stackTop -= 2;
+                    stackTop[-1] = value;
+                    DISPATCH();
+                }
             }
-            case OP_LESS: {
-                InterpretResult result = handleLess(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            SLOW_PATH(handleIndexSet);
+            DISPATCH();
+        }
+        CASE(OP_ITER_INIT): SLOW_PATH(handleIterInit); DISPATCH();
+        CASE(OP_ITER_NEXT): {
+            Value* sequence = &frame->slots[ip[0]];
+            if (IS_LIST(sequence[0]) && IS_NUMBER(sequence[1]) && ip[1] == 1) {
+                ObjList* list = AS_LIST(sequence[0]);
+                double position = AS_NUMBER(sequence[1]);
+                if (position >= 0 && position < list->count) {
+                    sequence[1] = NUMBER_VAL(position + 1);
+                    PUSH(listValues(list)[(int)position]);
+                    ip += 4;
+                } else {
+                    ip += 4 + OPERAND_SHORT(2);
+                }
+                DISPATCH();
             }
-            case OP_ADD: {
-                InterpretResult result = handleAdd(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            SLOW_PATH(handleIterNext);
+            DISPATCH();
+        }
+        CASE(OP_NOT):
+            stackTop[-1] = BOOL_VAL(isFalsey(stackTop[-1]));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_SUBTRACT: {
-                InterpretResult result = handleSubtract(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            stackTop[-1] = NUMBER_VAL(-AS_NUMBER(stackTop[-1]));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            SAVE_STATE();
+            Value value = peek(0);
+            if (IS_INSTANCE(value) && !vmToString(value, &value)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_MULTIPLY: {
-                InterpretResult result = handleMultiply(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            pop();
+            printValue(stdout, value);
+            printf("\n");
+            LOAD_STATE();
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            SAVE_STATE();
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DIVIDE: {
-                InterpretResult result = handleDivide(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            LOAD_STATE();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            ObjClosure* closure = NULL;
+            if (IS_CLOSURE(callee)) {
+                closure = AS_CLOSURE(callee);
+            } else if (IS_BOUND_METHOD(callee)) {
+                closure = AS_BOUND_METHOD(callee)->method;
+                stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
             }
-            case OP_NOT:      push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+
+            // Natives e classes não empilham um frame reaproveitável: segue
+            // como OP_CALL e o OP_RETURN seguinte devolve o resultado.
+            if (closure == NULL) {
+                SAVE_STATE();
+                if (!callValue(callee, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                *(vm.stackTop - 1) = NUMBER_VAL(-AS_NUMBER(*(vm.stackTop - 1)));
-                break;
-            case OP_PRINT: {
-                printValue(stdout, pop());
-                printf("\n");
-                break;
-            }
-            case OP_JUMP: {
-                InterpretResult result = handleJump(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+                LOAD_STATE();
+                DISPATCH();
             }
-            case OP_JUMP_IF_FALSE: {
-                InterpretResult result = handleJumpIfFalse(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
-            }
-            case OP_LOOP: {
-                InterpretResult result = handleLoop(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
-            }
-            case OP_CALL: {
-                InterpretResult result = handleCall(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
-            }
-            case OP_INVOKE: {
-                InterpretResult result = handleInvoke(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
-            }
-            case OP_SUPER_INVOKE: {
-                InterpretResult result = handleSuperInvoke(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+
+            if (argCount != closure->function->arity) {
+                RUNTIME_ERROR("Expected %d arguments but got %d.", closure->function->arity, argCount);
             }
-            case OP_CLOSURE: {
-                InterpretResult result = handleClosure(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+
+            closeUpvalues(frame->slots);
+            memmove(frame->slots, stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+            stackTop = frame->slots + argCount + 1;
+            int needed = (int)(frame->slots - vm.stack) + closure->function->maxStack + FRAME_STACK_RESERVE;
+            if (needed > vm.stackCapacity) {
+                vm.stackTop = stackTop;
+                ensureStack(needed);
+                stackTop = vm.stackTop;
             }
-            case OP_CLOSE_UPVALUE: {
-                closeUpvalues(vm.stackTop - 1);
-                pop();
-                break;
+            frame->closure = closure;
+            ip = closure->function->chunk.code;
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            int argCount = ip[2];
+            Value receiver = PEEK(argCount);
+            if (IS_INSTANCE(receiver)) {
+                ObjInstance* instance = AS_INSTANCE(receiver);
+                InlineCacheEntry* entry = findCacheEntry(CACHE_AT(3), instance);
+                if (entry != NULL && entry->slot < 0) {
+                    ip += 5;
+                    SAVE_STATE();
+                    if (!call(AS_CLOSURE(entry->method), argCount)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    LOAD_STATE();
+                    DISPATCH();
+                }
             }
-            case OP_RETURN: {
-                InterpretResult result = handleReturn(frame);
-                if (result != INTERPRET_OK) return result;
-                break;
+            SLOW_PATH(handleInvoke);
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): SLOW_PATH(handleSuperInvoke); DISPATCH();
+        CASE(OP_CLOSURE):      SLOW_PATH(handleClosure);     DISPATCH();
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(stackTop - 1);
+            stackTop--;
+            DISPATCH();
+        CASE(OP_RETURN): {
+            Value result = POP();
+            closeUpvalues(frame->slots);
+            vm.frameCount--;
+            if (vm.frameCount == vm.baseFrame) {
+                // Fim do script ou da chamada aninhada de callAndRun: o
+                // resultado fica no topo para quem chamou run().
+                vm.stackTop = frame->slots;
+                push(result);
+                return INTERPRET_OK;
             }
-            case OP_CLASS: {
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break;
+            stackTop = frame->slots;
+            PUSH(result);
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_CLASS): {
+            ObjString* name = READ_STRING();
+            SAVE_STATE();
+            ObjClass* klass = newClass(name);
+            PUSH(OBJ_VAL(klass));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
             }
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
-                break;
+            if (!IS_CLASS(PEEK(0))) RUNTIME_ERROR("Bytecode inválido.");
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            SAVE_STATE();
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            memcpy(subclass->operators, AS_CLASS(superclass)->operators, sizeof(subclass->operators));
+            rememberObject((Obj*)subclass);
+            stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            ObjString* name = READ_STRING();
+            if (!IS_CLASS(PEEK(1)) || !IS_CLOSURE(PEEK(0))) RUNTIME_ERROR("Bytecode inválido.");
+            SAVE_STATE();
+            defineMethod(name);
+            stackTop = vm.stackTop;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCALS): {
+            Value a = frame->slots[ip[0]];
+            Value b = frame->slots[ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                ip += 4;
+            } else {
+                PUSH(a);
+                ip++;
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            DISPATCH();
         }
+        CASE(OP_LESS_JUMP):     COMPARE_JUMP(<, handleLess);       DISPATCH();
+        CASE(OP_GREATER_JUMP):  COMPARE_JUMP(>, handleGreater);    DISPATCH();
+        CASE(OP_NOT_EQUAL):     NEGATED_COMPARE(==, handleEqual);  DISPATCH();
+        CASE(OP_GREATER_EQUAL): NEGATED_COMPARE(<, handleLess);    DISPATCH();
+        CASE(OP_LESS_EQUAL):    NEGATED_COMPARE(>, handleGreater); DISPATCH();
     }
 
+    return INTERPRET_RUNTIME_ERROR;
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_CONSTANT_16
 #undef READ_STRING
+#undef OPERAND_SHORT
+#undef CACHE_AT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SAVE_STATE
+#undef LOAD_FRAME
+#undef LOAD_STATE
+#undef SLOW_PATH
+#undef RUNTIME_ERROR
+#undef QUICKEN
+#undef DEOPTIMIZE
 #undef BINARY_OP
+#undef QUICKENED_OP
+#undef COMPARE_JUMP
+#undef NEGATED_COMPARE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
     if (debugAstMode) return INTERPRET_OK;
+    return interpretFunction(function);
+}
+
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
-    return run();
+    InterpretResult result = run();
+    if (result == INTERPRET_OK) pop();
+    return result;
+}
+
+// Roda callee, já empilhado com os argumentos (para métodos, o receptor no
+// lugar dele), num laço de despacho aninhado até o frame dele retornar.
+static bool callAndRun(Value callee, int argCount, Value* out) {
+    int frameCount = vm.frameCount;
+    if (!callValue(callee, argCount)) return false;
+    if (vm.frameCount > frameCount) {
+        int baseFrame = vm.baseFrame;
+        vm.baseFrame = frameCount;
+        InterpretResult result = run();
+        vm.baseFrame = baseFrame;
+        if (result != INTERPRET_OK) return false;
+    }
+    *out = pop();
+    return true;
 }
 
-Value getToStringValue(Value instance) {
-    if (!IS_INSTANCE(instance)) return NIL_VAL;
-    ObjInstance* obj = AS_INSTANCE(instance);
-    ObjString* methodName = copyString("toString", 8);
-    Value method;
-    if (!tableGet(&obj->klass->methods, methodName, &method)) {
-        return NIL_VAL;
-    }
-    
-    Value* oldStackTop = vm.stackTop;
-    int oldFrameCount = vm.frameCount;
-    
-    push(instance); 
-    bool success = callValue(method, 0);
-    
-    if (success && vm.frameCount > oldFrameCount) {
-        Value result = pop();
-        vm.stackTop = oldStackTop;
-        vm.frameCount = oldFrameCount;
-        return result;
+static bool callWithReceiver(Value receiver, Value callee, int argCount, Value* args, Value* out) {
+    // args pode apontar para a própria pilha, que ensureStack pode mover.
+    bool onStack = args >= vm.stack && args < vm.stack + vm.stackCapacity;
+    int argsOffset = onStack ? (int)(args - vm.stack) : 0;
+    ensureStack((int)(vm.stackTop - vm.stack) + argCount + 1);
+    if (onStack) args = vm.stack + argsOffset;
+
+    push(receiver);
+    for (int i = 0; i < argCount; i++) push(args[i]);
+    return callAndRun(callee, argCount, out);
+}
+
+// Chamada reentrante para nativas: roda callee até retornar e devolve o
+// resultado em out. A pilha pode ser realocada durante a chamada, então
+// ponteiros para ela (como o args da nativa) deixam de valer.
+bool vmCall(Value callee, int argCount, Value* args, Value* out) {
+    return callWithReceiver(callee, callee, argCount, args, out);
+}
+
+static uint32_t hashBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// Hash de chave de dicionário. Números iguais têm o mesmo hash (0 e -0
+// inclusive); strings usam o hash do conteúdo; instâncias com __hash__
+// usam o número que ele devolve; o resto vale pela identidade.
+bool hashValue(Value value, uint32_t* hash) {
+    if (IS_STRING(value)) {
+        *hash = AS_STRING(value)->hash;
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        if (number == 0) number = 0;
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        *hash = hashBits(bits);
+    } else if (IS_BOOL(value)) {
+        *hash = AS_BOOL(value) ? 1231 : 1237;
+    } else if (IS_NIL(value)) {
+        *hash = 0;
+    } else if (IS_INSTANCE(value) && !IS_NIL(AS_INSTANCE(value)->klass->operators[OPERATOR_HASH])) {
+        Value result;
+        if (!callWithReceiver(value, AS_INSTANCE(value)->klass->operators[OPERATOR_HASH], 0, NULL, &result)) {
+            return false;
+        }
+        if (!IS_NUMBER(result)) {
+            runtimeError("__hash__ deve retornar um número.");
+            return false;
+        }
+        return hashValue(result, hash);
     } else {
-        vm.stackTop = oldStackTop;
-        vm.frameCount = oldFrameCount;
-        return OBJ_VAL(copyString("[has toString]", 13));
+        *hash = hashBits((uint64_t)(uintptr_t)AS_OBJ(value));
+    }
+    return true;
+}
+
+// Igualdade de chaves: valuesEqual, ou o __eq__ de uma das instâncias.
+bool keysEqual(Value a, Value b, bool* equal) {
+    *equal = valuesEqual(a, b);
+    if (*equal) return true;
+
+    Value receiver = a;
+    Value other = b;
+    if (!IS_INSTANCE(receiver) || IS_NIL(AS_INSTANCE(receiver)->klass->operators[OPERATOR_EQ])) {
+        receiver = b;
+        other = a;
     }
+    if (!IS_INSTANCE(receiver)) return true;
+    Value method = AS_INSTANCE(receiver)->klass->operators[OPERATOR_EQ];
+    if (IS_NIL(method)) return true;
+
+    Value result;
+    if (!callWithReceiver(receiver, method, 1, &other, &result)) return false;
+    *equal = !isFalsey(result);
+    return true;
+}
+
+// Chama toString() da instância; out fica nil se a classe não tiver um.
+// Devolve false se o método gerou erro de execução.
+bool getToStringValue(Value instance, Value* out) {
+    *out = NIL_VAL;
+    if (!IS_INSTANCE(instance)) return true;
+    Value method;
+    if (!tableGet(&AS_INSTANCE(instance)->klass->methods, vm.toStringString, &method)) {
+        return true;
+    }
+    return callWithReceiver(instance, method, 0, NULL, out);
 }
 
 Value valueToString(Value value) {
-    if (IS_STRING(value)) {
+    if (IS_STRING_LIKE(value)) {
         return value;
     } else if (IS_NUMBER(value)) {
         char buffer[32];
-        snprintf(buffer, sizeof(buffer), "%g", AS_NUMBER(value));
-        return OBJ_VAL(copyString(buffer, strlen(buffer)));
+        int length = formatNumber(buffer, sizeof(buffer), AS_NUMBER(value));
+        return OBJ_VAL(copyString(buffer, length));
     } else if (IS_BOOL(value)) {
         return OBJ_VAL(copyString(AS_BOOL(value) ? "true" : "false", 
                                  AS_BOOL(value) ? 4 : 5));
     } else if (IS_NIL(value)) {
         return OBJ_VAL(copyString("nil", 3));
     } else if (IS_INSTANCE(value)) {
-        return getToStringValue(value);
+        char buffer[64];
+        snprintf(buffer, sizeof(buffer), "%s instance", AS_INSTANCE(value)->klass->name->chars);
+        return OBJ_VAL(copyString(buffer, strlen(buffer)));
     } else if (IS_LIST(value)) {
         return OBJ_VAL(copyString("[list]", 6));
     } else if (IS_DICT(value)) {
         return OBJ_VAL(copyString("[dict]", 6));
+    } else if (IS_F64ARRAY(value)) {
+        return OBJ_VAL(copyString("[f64array]", 10));
     } else if (IS_ENUM(value)) {
         ObjEnum* enumObj = AS_ENUM(value);
         char buffer[64];
@@ -1172,28 +2433,11 @@ Value valueToString(Value value) {
     }
 }
 
-Value vmToString(Value instance) {
-    if (!IS_INSTANCE(instance)) return valueToString(instance);
-    ObjInstance* obj = AS_INSTANCE(instance);
-    ObjString* methodName = NULL;
-    for (int i = 0; i < obj->klass->methods.capacity; i++) {
-        Entry* entry = &obj->klass->methods.entries[i];
-        if (entry->key != NULL && strcmp(entry->key->chars, "toString") == 0) {
-            methodName = entry->key;
-            break;
-        }
-    }
-    if (methodName == NULL) return OBJ_VAL(copyString("[object]", 8));
-    push(instance);
-    if (!invoke(methodName, 0)) {
-        pop();
-        return OBJ_VAL(copyString("[object]", 8));
-    }
-    InterpretResult result = run();
-    if (result != INTERPRET_OK) {
-        return OBJ_VAL(copyString("[object]", 8));
-    }
-    Value strResult = pop();
-    return valueToString(strResult);
+// Como valueToString, mas usa o toString() das instâncias que o definem.
+bool vmToString(Value value, Value* out) {
+    Value string;
+    if (!getToStringValue(value, &string)) return false;
+    *out = valueToString(IS_NIL(string) ? value : string);
+    return true;
 }
 
@@ -5,8 +5,16 @@
 #include "table.h"
 #include "object.h"
 
-#define FRAMES_MAX 512
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Pilha de valores e de frames começam pequenas e crescem sob demanda até
+// vm.maxFrames (FRAMES_MAX por padrão, ajustável com --max-frames).
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+// Folga acima de function->maxStack a cada chamada, para os temporários que
+// handlers e natives empilham com push() (protegidos do GC).
+#define FRAME_STACK_RESERVE 16
 
 typedef struct {
     ObjClosure* closure;
@@ -14,24 +22,60 @@ typedef struct {
     Value* slots;
 } CallFrame;
 
+// Fases de uma coleta completa incremental; coletas menores são sempre atômicas.
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP
+} GCPhase;
+
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame* frames;
     int frameCount;
+    int frameCapacity;
+    int maxFrames;
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
-    Table globals;
+    int stackCapacity;
+    Table globalNames;          // nome -> índice em globalValues
+    ValueArray globalValues;    // UNDEFINED_VAL até a definição rodar
     Table strings;
     ObjString* initString;
+    ObjString* toStringString;
+    ObjString* operatorNames[OPERATOR_COUNT];
+    ObjShape* emptyShape;
     ObjUpvalue* openUpvalues;
+    int baseFrame;              // run() retorna quando frameCount volta a este valor
+
+    int quickenedCount;
+    int deoptimizedCount;
 
     size_t bytesAllocated;
-    size_t nextGC;
-    Obj* objects;
+    size_t nextGC;        // próxima coleta menor
+    size_t nextFullGC;    // acima disso a coleta percorre o heap inteiro
+    size_t bytesAtLastGC; // bytesAllocated ao fim da última pausa
+    size_t youngBytes;    // alocados desde a última coleta menor
+    size_t gcDebt;        // alocados desde a última fatia da coleta completa
+    Obj* objects;         // geração velha
+    Obj* youngObjects;    // alocados desde a última coleta
+    bool minorGC;
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;
+    GCPhase gcPhase;
+    int gcRescans;
+    int gcPauseBudget;    // µs por fatia da coleta completa; 0 = para o mundo
+    Obj* unsweptYoung;    // listas ainda não varridas na fase GC_SWEEP
+    Obj* unsweptOld;
+    int minorCollections;
+    int fullCollections;
+    int gcSlices;
+    double gcMaxPause;    // maior pausa observada, em µs
 } VM;
 
 typedef enum {
@@ -45,12 +89,18 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 void push(Value value);
 Value pop();
 bool callValue(Value callee, int argCount);
-Value getToStringValue(Value instance);
+bool vmCall(Value callee, int argCount, Value* args, Value* out);
+bool hashValue(Value value, uint32_t* hash);
+bool keysEqual(Value a, Value b, bool* equal);
+bool getToStringValue(Value instance, Value* out);
 Value valueToString(Value value);
 bool invoke(ObjString* name, int argCount);
-Value vmToString(Value instance);
+bool vmToString(Value value, Value* out);
+void printVMStats();
+int globalSlot(ObjString* name);
 
 #endif
\ No newline at end of file